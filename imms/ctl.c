@@ -0,0 +1,126 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include "perf.h"
+#include "imms_ctl.h"
+
+#define CTL_MALLOPT_PREFIX  "mallopt."
+
+/* Copies a read only value out */
+static int ctl_read(void *oldp, size_t *oldlenp, const void *newp, const void *value, size_t len)
+{
+    if (newp)
+        return EPERM;
+    if (!oldp)
+        return 0;
+    if (!oldlenp || *oldlenp != len)
+        return EINVAL;
+    memcpy(oldp, value, len);
+
+    return 0;
+}
+
+static int ctl_stats(const char *name, void *oldp, size_t *oldlenp, const void *newp)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } fields[] = {
+        { "stats.allocated",    offsetof(imms_malloc_stats_t, allocated) },
+        { "stats.active",       offsetof(imms_malloc_stats_t, active) },
+        { "stats.resident",     offsetof(imms_malloc_stats_t, resident) },
+        { "stats.retained",     offsetof(imms_malloc_stats_t, retained) },
+        { "stats.metadata",     offsetof(imms_malloc_stats_t, metadata) },
+    };
+    imms_malloc_stats_t stats;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (strcmp(name, fields[i].name))
+            continue;
+        if (!imms_malloc_stats(&stats))
+            return ENOENT;
+        return ctl_read(oldp, oldlenp, newp, (char*)&stats + fields[i].offset, sizeof(size_t));
+    }
+
+    return -1;
+}
+
+/* Names which aren't IMMS's own are the allocator's */
+static int ctl_native(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen)
+{
+    const imms_malloc_funcs_t *mf = &imms_malloc_funcs[imms_loaded_malloc_lib];
+
+    if (mf->mallctl)
+        return mf->mallctl(name, oldp, oldlenp, newp, newlen);
+    if (!mf->get_property)
+        return ENOENT;
+    if (oldp) {
+        if (!oldlenp || *oldlenp != sizeof(size_t))
+            return EINVAL;
+        if (mf->get_property(name, oldp) != 1)
+            return ENOENT;
+    }
+    if (newp) {
+        if (newlen != sizeof(size_t))
+            return EINVAL;
+        if (!mf->set_property || mf->set_property(name, *(size_t*)newp) != 1)
+            return ENOENT;
+    }
+
+    return 0;
+}
+
+/**********************************************************************
+ * The single entry point applications use to look into the allocator,
+ * see imms_ctl.h. The names of IMMS are answered the same way whichever
+ * allocator is loaded; the rest reach the allocator.
+ **********************************************************************/
+int imms_ctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen)
+{
+    const char *libname;
+    int param, ret;
+
+    if (!name)
+        return EINVAL;
+    if (!imms_init((void**)&imms_malloc))
+        return ENOENT;
+    if (!strcmp(name, "allocator")) {
+        libname = imms_malloc_libs[imms_loaded_malloc_lib].name;
+        return ctl_read(oldp, oldlenp, newp, &libname, sizeof(libname));
+    }
+    if (!strcmp(name, "test_mode"))
+        return ctl_read(oldp, oldlenp, newp, &imms_perf_test_mode, sizeof(imms_perf_test_mode));
+    if ((ret = ctl_stats(name, oldp, oldlenp, newp)) != -1)
+        return ret;
+    if (!strncmp(name, CTL_MALLOPT_PREFIX, sizeof(CTL_MALLOPT_PREFIX) - 1)) {
+        if (oldp)
+            return EPERM;
+        if (!(param = imms_mallopt_param(name + sizeof(CTL_MALLOPT_PREFIX) - 1)))
+            return ENOENT;
+        if (!newp)
+            return 0;
+        if (newlen != sizeof(int))
+            return EINVAL;
+        return imms_mallopt(param, *(int*)newp) ? 0 : EINVAL;
+    }
+
+    return ctl_native(name, oldp, oldlenp, newp, newlen);
+}
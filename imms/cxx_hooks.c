@@ -0,0 +1,185 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <malloc.h>
+#include "perf.h"
+
+/*
+ *  C++ operator new/delete overloads, defined by their mangled names so that
+ *  sized and aligned deletes reach the allocator's sized entry points instead of
+ *  going through libstdc++'s forwarding to malloc/free.
+ */
+#if __SIZEOF_SIZE_T__ == 8
+    #define CXX_SIZE_T          "m"
+#else
+    #define CXX_SIZE_T          "j"
+#endif
+#define CXX_NOTHROW             "RKSt9nothrow_t"
+#define CXX_ALIGN               "St11align_val_t"
+
+typedef void (*new_handler_t)(void);
+
+/* Weak, so that C programs which don't link libstdc++ still load IMMS */
+extern new_handler_t _ZSt15get_new_handlerv(void) __attribute__((weak));
+extern void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+/* Throwing new retries after the new_handler and throws std::bad_alloc when there is none */
+static void* cxx_new(size_t alignment, size_t size, bool nothrow)
+{
+    new_handler_t handler;
+    void *p;
+
+    if (!size)
+        size = 1;
+    for (;;) {
+        p = alignment ? memalign(alignment, size) : malloc(size);
+        if (p)
+            return p;
+        /* A C frame can't catch what the handler throws, so nothrow new gives up here */
+        if (nothrow)
+            return NULL;
+        handler = _ZSt15get_new_handlerv ? _ZSt15get_new_handlerv() : NULL;
+        if (!handler)
+            break;
+        handler();
+    }
+    if (_ZSt17__throw_bad_allocv)
+        _ZSt17__throw_bad_allocv();
+    abort();
+}
+
+void* cxx_new_(size_t size) __asm__("_Znw" CXX_SIZE_T);
+void* cxx_new_(size_t size)
+{
+    return cxx_new(0, size, false);
+}
+
+void* cxx_new_array(size_t size) __asm__("_Zna" CXX_SIZE_T);
+void* cxx_new_array(size_t size)
+{
+    return cxx_new(0, size, false);
+}
+
+void* cxx_new_nothrow(size_t size, const void *nt) __asm__("_Znw" CXX_SIZE_T CXX_NOTHROW);
+void* cxx_new_nothrow(size_t size, const void *nt)
+{
+    return cxx_new(0, size, true);
+}
+
+void* cxx_new_array_nothrow(size_t size, const void *nt) __asm__("_Zna" CXX_SIZE_T CXX_NOTHROW);
+void* cxx_new_array_nothrow(size_t size, const void *nt)
+{
+    return cxx_new(0, size, true);
+}
+
+void* cxx_new_aligned(size_t size, size_t alignment) __asm__("_Znw" CXX_SIZE_T CXX_ALIGN);
+void* cxx_new_aligned(size_t size, size_t alignment)
+{
+    return cxx_new(alignment, size, false);
+}
+
+void* cxx_new_array_aligned(size_t size, size_t alignment) __asm__("_Zna" CXX_SIZE_T CXX_ALIGN);
+void* cxx_new_array_aligned(size_t size, size_t alignment)
+{
+    return cxx_new(alignment, size, false);
+}
+
+void* cxx_new_aligned_nothrow(size_t size, size_t alignment, const void *nt) __asm__("_Znw" CXX_SIZE_T CXX_ALIGN CXX_NOTHROW);
+void* cxx_new_aligned_nothrow(size_t size, size_t alignment, const void *nt)
+{
+    return cxx_new(alignment, size, true);
+}
+
+void* cxx_new_array_aligned_nothrow(size_t size, size_t alignment, const void *nt) __asm__("_Zna" CXX_SIZE_T CXX_ALIGN CXX_NOTHROW);
+void* cxx_new_array_aligned_nothrow(size_t size, size_t alignment, const void *nt)
+{
+    return cxx_new(alignment, size, true);
+}
+
+void cxx_delete(void *ptr) __asm__("_ZdlPv");
+void cxx_delete(void *ptr)
+{
+    free(ptr);
+}
+
+void cxx_delete_array(void *ptr) __asm__("_ZdaPv");
+void cxx_delete_array(void *ptr)
+{
+    free(ptr);
+}
+
+void cxx_delete_nothrow(void *ptr, const void *nt) __asm__("_ZdlPv" CXX_NOTHROW);
+void cxx_delete_nothrow(void *ptr, const void *nt)
+{
+    free(ptr);
+}
+
+void cxx_delete_array_nothrow(void *ptr, const void *nt) __asm__("_ZdaPv" CXX_NOTHROW);
+void cxx_delete_array_nothrow(void *ptr, const void *nt)
+{
+    free(ptr);
+}
+
+void cxx_delete_sized(void *ptr, size_t size) __asm__("_ZdlPv" CXX_SIZE_T);
+void cxx_delete_sized(void *ptr, size_t size)
+{
+    free_sized(ptr, size);
+}
+
+void cxx_delete_array_sized(void *ptr, size_t size) __asm__("_ZdaPv" CXX_SIZE_T);
+void cxx_delete_array_sized(void *ptr, size_t size)
+{
+    free_sized(ptr, size);
+}
+
+void cxx_delete_aligned(void *ptr, size_t alignment) __asm__("_ZdlPv" CXX_ALIGN);
+void cxx_delete_aligned(void *ptr, size_t alignment)
+{
+    free(ptr);
+}
+
+void cxx_delete_array_aligned(void *ptr, size_t alignment) __asm__("_ZdaPv" CXX_ALIGN);
+void cxx_delete_array_aligned(void *ptr, size_t alignment)
+{
+    free(ptr);
+}
+
+void cxx_delete_aligned_nothrow(void *ptr, size_t alignment, const void *nt) __asm__("_ZdlPv" CXX_ALIGN CXX_NOTHROW);
+void cxx_delete_aligned_nothrow(void *ptr, size_t alignment, const void *nt)
+{
+    free(ptr);
+}
+
+void cxx_delete_array_aligned_nothrow(void *ptr, size_t alignment, const void *nt) __asm__("_ZdaPv" CXX_ALIGN CXX_NOTHROW);
+void cxx_delete_array_aligned_nothrow(void *ptr, size_t alignment, const void *nt)
+{
+    free(ptr);
+}
+
+void cxx_delete_sized_aligned(void *ptr, size_t size, size_t alignment) __asm__("_ZdlPv" CXX_SIZE_T CXX_ALIGN);
+void cxx_delete_sized_aligned(void *ptr, size_t size, size_t alignment)
+{
+    free_aligned_sized(ptr, alignment, size);
+}
+
+void cxx_delete_array_sized_aligned(void *ptr, size_t size, size_t alignment) __asm__("_ZdaPv" CXX_SIZE_T CXX_ALIGN);
+void cxx_delete_array_sized_aligned(void *ptr, size_t size, size_t alignment)
+{
+    free_aligned_sized(ptr, alignment, size);
+}
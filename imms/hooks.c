@@ -40,6 +40,7 @@ void* malloc(size_t size)
 	IMMS_PERF_INIT(IMMS_PERF_MALLOC);
 	if (!imms_init((void**)&imms_malloc))
 		return alloc(size);
+	imms_swap_poll();
 	IMMS_PERF_BEGIN(NULL);
 	p = imms_malloc(size);
 	IMMS_PERF_END(p);
@@ -55,6 +56,7 @@ void* realloc(void *ptr, size_t size)
 	IMMS_PERF_INIT(IMMS_PERF_REALLOC);
 	if (!imms_init((void**)&imms_realloc))
 		return NULL;
+	imms_swap_poll();
 	IMMS_PERF_BEGIN(ptr);
 	p = imms_realloc(ptr, size);
 	IMMS_PERF_END(p);
@@ -70,6 +72,7 @@ void* memalign(size_t alignment, size_t size)
 	IMMS_PERF_INIT(IMMS_PERF_MEMALIGN);
 	if (!imms_init((void**)&imms_memalign))
 		return NULL;
+	imms_swap_poll();
 	IMMS_PERF_BEGIN(NULL);
 	p = imms_memalign(alignment, size);
 	IMMS_PERF_END(p);
@@ -78,6 +81,7 @@ void* memalign(size_t alignment, size_t size)
     return p;
 }
 
+/* The frees don't poll: a block goes back to its owner whichever allocator is current, only the allocations follow a swap */
 void free(void *ptr)
 {
 	IMMS_PERF_INIT(IMMS_PERF_FREE);
@@ -89,19 +93,73 @@ void free(void *ptr)
 	IMMS_PERF_END(NULL);
 }
 
+/* The size spares the allocator from looking it up */
+void free_sized(void *ptr, size_t size)
+{
+	IMMS_PERF_INIT(IMMS_PERF_FREE);
+	IMMS_VERBOSE_STD("free_sized", ptr);
+	if (!ptr || !imms_init((void**)&imms_free))
+		return;
+	IMMS_PERF_BEGIN(ptr);
+	if (imms_free_sized)
+        imms_free_sized(ptr, size);
+	else
+        imms_free(ptr);
+	IMMS_PERF_END(NULL);
+}
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+	IMMS_PERF_INIT(IMMS_PERF_FREE);
+	IMMS_VERBOSE_STD("free_aligned_sized", ptr);
+	if (!ptr || !imms_init((void**)&imms_free))
+		return;
+	IMMS_PERF_BEGIN(ptr);
+	if (imms_free_aligned_sized)
+        imms_free_aligned_sized(ptr, alignment, size);
+	else
+        imms_free(ptr);
+	IMMS_PERF_END(NULL);
+}
+
 void* calloc(size_t numelm, size_t elmsize)
 {
 	void *p;
     size_t size;
 
-	size = numelm * elmsize;
-	p = malloc(size);
-	if (p && size)
-        memset(p, 0, size);
+	IMMS_PERF_INIT(IMMS_PERF_CALLOC);
+	if (__builtin_mul_overflow(numelm, elmsize, &size)) {
+        errno = ENOMEM;
+        return NULL;
+	}
+	if (!imms_init((void**)&imms_calloc)) {
+        /* dlsym asks for zeroed memory while the allocator is being loaded */
+		if ((p = alloc(size)))
+            memset(p, 0, size);
+        return p;
+	}
+	imms_swap_poll();
+	/* The allocator knows which of its memory is already zero */
+	IMMS_PERF_BEGIN(NULL);
+	p = imms_calloc(numelm, elmsize);
+	IMMS_PERF_END(p);
+	IMMS_VERBOSE_STD("calloc", p);
 
     return p;
 }
 
+void* reallocarray(void *ptr, size_t numelm, size_t elmsize)
+{
+    size_t size;
+
+	if (__builtin_mul_overflow(numelm, elmsize, &size)) {
+        errno = ENOMEM;
+        return NULL;
+	}
+
+    return realloc(ptr, size);
+}
+
 int posix_memalign(void **ptr, size_t alignment, size_t size)
 {
 	if (!alignment || (alignment & (alignment - 1)))
@@ -126,17 +184,13 @@ void* aligned_alloc(size_t alignment, size_t size)
 void* valloc(size_t size)
 {
 	static long pagesize = 0;
-	static char initialised = 0;
-
-	if (initialised != 3) {
-		if (!__sync_fetch_and_or(&initialised, 1)) {
-			pagesize = sysconf(_SC_PAGESIZE);
-			if (pagesize < 1)
-				pagesize = 4096;
-			__sync_fetch_and_or(&initialised, 2);
-		} else
-			while (1 == initialised)
-				usleep(1000);
+	static int once = IMMS_ONCE_NONE;
+
+	if (imms_once(&once)) {
+		pagesize = sysconf(_SC_PAGESIZE);
+		if (pagesize < 1)
+			pagesize = 4096;
+		imms_once_done(&once);
 	}
 
 	return memalign(pagesize, size);
@@ -145,18 +199,14 @@ void* valloc(size_t size)
 void* pvalloc(size_t size)
 {
 	static long pagemask = 0;
-	static char initialised = 0;
-
-	if (initialised != 3) {
-		if (!__sync_fetch_and_or(&initialised, 1)) {
-			pagemask = sysconf(_SC_PAGESIZE);
-			if (pagemask < 1)
-				pagemask = 4096;
-            pagemask--;
-			__sync_fetch_and_or(&initialised, 2);
-		} else
-			while (1 == initialised)
-				usleep(1000);
+	static int once = IMMS_ONCE_NONE;
+
+	if (imms_once(&once)) {
+		pagemask = sysconf(_SC_PAGESIZE);
+		if (pagemask < 1)
+			pagemask = 4096;
+        pagemask--;
+		imms_once_done(&once);
 	}
 
 	return valloc((size + pagemask) & ~pagemask);
@@ -189,15 +239,17 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void* (*start_
 	if (!imms_init((void**)&imms_pthread_create))
 		return EAGAIN;
 
-	return imms_pthread_create(thread, attr, start_routine, arg);
+	return imms_perf_thread_create(thread, attr, start_routine, arg);
 }
 
 void pthread_exit(void *retval)
 {
     IMMS_VERBOSE_MSG("pthread_exit called");
+	/* The thread can't be ended without the real pthread_exit */
 	if (!imms_init((void**)&imms_pthread_exit))
-		return;
+		abort();
 	imms_pthread_exit(retval);
+	__builtin_unreachable();
 }
 
 
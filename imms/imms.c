@@ -19,30 +19,25 @@
 
 #include "perf.h"
 
-bool imms_init(void **imms_func)
+int imms_initialised = IMMS_ONCE_NONE;
+
+bool imms_init_slow(void **imms_func)
 {
-	static char initialised = 0;
 	static pid_t tid = 0;
 
-    if (initialised != 3) {
-        if (__sync_fetch_and_or(&initialised, 1)) {
-            if (syscall(SYS_gettid) == tid) {
-                IMMS_VERBOSE_MSGWPTR("imms_init gettid() == tid; tid =", tid);
-            } else {
-                IMMS_VERBOSE_MSGWPTR("imms_init thread is waiting; tid =", syscall(SYS_gettid));
-                while (1 == initialised)
-                    usleep(1000);
-            }
-        } else {
-            IMMS_VERBOSE_MSG("imms is initilising...");
-            IMMS_VERBOSE_MSG(imms_process_filepath());
-            tid = syscall(SYS_gettid);
-            IMMS_VERBOSE_MSGWPTR("imms_init tid =", tid);
-            imms_load_malloc_lib();
-            __sync_fetch_and_or(&initialised, 2);
-            IMMS_VERBOSE_MSG("imms initialised");
-        }
-	}
+    /* The allocator's own loading may call the hooks again; they are served by the fallbacks */
+    if (__atomic_load_n(&imms_initialised, __ATOMIC_ACQUIRE) != IMMS_ONCE_DONE && syscall(SYS_gettid) == tid) {
+        IMMS_VERBOSE_MSGWPTR("imms_init gettid() == tid; tid =", tid);
+    } else if (imms_once(&imms_initialised)) {
+        IMMS_VERBOSE_MSG("imms is initilising...");
+        IMMS_VERBOSE_MSG(imms_process_filepath());
+        tid = syscall(SYS_gettid);
+        IMMS_VERBOSE_MSGWPTR("imms_init tid =", tid);
+        imms_load_malloc_lib();
+        tid = 0;
+        imms_once_done(&imms_initialised);
+        IMMS_VERBOSE_MSG("imms initialised");
+    }
 
 	return *imms_func ? true : false;
 }
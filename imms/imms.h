@@ -22,13 +22,17 @@
 #endif
 
 #include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/file.h>
 #include <sys/sysinfo.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -39,7 +43,6 @@
 #include <semaphore.h>
 #include <string.h>
 #include <errno.h>
-#include "malloc_libs.h"
 
 #define IMMS_PATH                       "/imms/"
 #define IMMS_PERF_LOGS_PATH             IMMS_PATH "perf-logs/"
@@ -47,10 +50,18 @@
 #define IMMS_FAILED_PERF_LOGS_PATH      IMMS_PERF_LOGS_PATH "failed/"
 #define IMMS_PERF_RES_PATH              IMMS_PATH "perf-res/"
 #define IMMS_LOCK_PATH                  IMMS_PATH "lock/"
+#define IMMS_SHARED_PATH                "/dev/shm/imms/"
 #define IMMS_MALLOC_LIB_PATH            IMMS_PATH "memallocs/"
+#define IMMS_CGROUP_PATH                "/sys/fs/cgroup"        /* Where cgroup v2 is mounted */
+#define IMMS_PRESSURE_PATH              "/proc/pressure/"
+#define IMMS_SYSFS_PATH                 "/sys"                  /* IMMS_SYSFS_ROOT in the environment overrides it, for a fake topology */
+#define IMMS_NUMA_NODES_MAX             64
+#define IMMS_NUMA_CPUS_MAX              1024
 #define	itoa        imms_itoa
 //#define	IMMS_VERBOSE
 #define IMMS_LOGGING
+#define IMMS_PERF_TSC       /* Time with the invariant TSC if the CPU has one, CLOCK_MONOTONIC_RAW otherwise */
+#define IMMS_HOT_SWAP       /* immsd may swap the allocator of a running process, under test or with swap=yes in its policy rule */
 
 #ifdef	IMMS_VERBOSE
 	#define	IMMS_VERBOSE_MSG(msg)       puts(msg)
@@ -79,23 +90,69 @@
 	typedef char bool;
 #endif
 
+#define IMMS_ONCE_NONE      0
+#define IMMS_ONCE_RUNNING   1
+#define IMMS_ONCE_WAITING   2       /* Running and some threads sleep on the futex */
+#define IMMS_ONCE_DONE      3
+
 typedef unsigned char imms_library_t;
 
+#include "malloc_libs.h"
+#include "policy.h"
+
+extern int imms_initialised;
+
+/* Resident memory of a process in bytes */
+typedef struct {
+    size_t rss;
+    size_t anon;            /* The heap of the allocator is anonymous memory */
+    size_t swap;            /* Only smaps_rollup tells it */
+} imms_mem_usage_t;
+
+/* The memory and CPU a process may use, see imms_read_budget */
+typedef struct {
+    size_t mem_free;        /* Bytes the process can take before its cgroup or the host runs out */
+    double cpus;            /* CPUs the process may use */
+    double cpu_load;        /* 5-minute load average per CPU of the budget */
+    double cpu_pressure;    /* Share of the last 60 s some tasks waited for a CPU, -1 without PSI */
+    double mem_pressure;    /* Share of the last 60 s some tasks waited for memory, -1 without PSI */
+} imms_budget_t;
+
+/* The NUMA topology of the host */
 typedef struct {
-    imms_library_t lib;
-    bool test_mode;
-} imms_shared_info_t;
+    unsigned int nnodes;                            /* Online nodes */
+    unsigned char node[IMMS_NUMA_NODES_MAX];        /* Their ids */
+    unsigned char cpu_node[IMMS_NUMA_CPUS_MAX];     /* Node of each CPU */
+} imms_numa_t;
 
 char* imms_itoa(long value, char *result, int base);
-bool imms_init(void **imms_func);
+bool imms_init_slow(void **imms_func);
+bool imms_once(int *once);
+void imms_once_done(int *once);
+void imms_once_fail(int *once);
 bool imms_open_perf_log_file(char *szfile, const size_t len, const char *szdir);
 bool imms_make_log_file(const char *szdir, char *szfile, const size_t len, const bool bperflog);
 void imms_init_daemon(char *dname);
 char* imms_process_filename();
 char* imms_process_filepath();
+char* imms_process_key();
 bool imms_is_process_excluded();
 long double imms_average(long double avg, long double add, long double count);
 long double imms_average_winc(long double avg, long double add, long double count, long double inc);
-void imms_share_info(imms_library_t lib, bool test_mode);
-imms_shared_info_t imms_read_shared_info(pid_t pid);
-size_t imms_get_mem_usage(pid_t pid, bool self);
+int imms_open_mem_usage(pid_t pid, const char *file);
+bool imms_read_mem_usage(int fd, imms_mem_usage_t *usage);
+bool imms_read_budget(imms_budget_t *budget);
+const imms_numa_t* imms_numa_topology();
+
+/* C23 hooks which libc may not declare yet */
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+/* Once the allocator is loaded, hooks only pay for a flag check and the call through the function pointer */
+static inline bool imms_init(void **imms_func)
+{
+    if (__builtin_expect(__atomic_load_n(&imms_initialised, __ATOMIC_ACQUIRE) == IMMS_ONCE_DONE, 1))
+        return *imms_func ? true : false;
+
+    return imms_init_slow(imms_func);
+}
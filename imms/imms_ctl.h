@@ -0,0 +1,49 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMMS_CTL_H
+#define IMMS_CTL_H
+
+#include <stddef.h>
+
+/*
+ *  Introspection and control of the allocator IMMS loaded, whichever it is. Modelled on
+ *  jemalloc's mallctl: a value is read into oldp when it isn't NULL, *oldlenp telling its
+ *  size, and written from newp when it isn't NULL. The names are:
+ *
+ *      allocator           const char*     r   Name of the allocator in the registry
+ *      test_mode           bool            r   Whether the calls are being timed
+ *      stats.allocated     size_t          r   Bytes allocated by the application
+ *      stats.active        size_t          r   Bytes in the pages of live blocks
+ *      stats.resident      size_t          r   Bytes the allocator keeps resident
+ *      stats.retained      size_t          r   Bytes the allocator keeps mapped but gave back
+ *      stats.metadata      size_t          r   Bytes of the allocator's own bookkeeping
+ *      mallopt.<param>     int             w   mallopt, the parameter named as in the registry
+ *
+ *  The statistics are summed over every allocator the process has loaded, as the blocks of
+ *  the previous ones live on after a swap; they are missing if one of them has none.
+ *
+ *  Other names go to the allocator itself: to mallctl if it has one, to its numeric
+ *  properties (size_t) otherwise. Returns 0, or ENOENT for an unknown name, EINVAL for a
+ *  value of the wrong size or which the allocator refused, EPERM for writing a read only
+ *  name. Applications which may run without IMMS should look it up with dlsym.
+ */
+int imms_ctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+
+#endif /* IMMS_CTL_H */
@@ -20,38 +20,44 @@
 #include "perf.h"
 
 #define DL_FLAGS    RTLD_NOW | RTLD_NODELETE
+#define SELECT_CPU_LOAD     0.75    /* Load per CPU of the budget which makes the fastest allocator worth its memory */
+#define SELECT_PRESSURE     0.10    /* Share of time stalled on CPU or memory which counts as pressure */
 
 void* (*imms_malloc)(size_t);
 void* (*imms_realloc)(void*, size_t);
 void (*imms_free)(void*);
+void (*imms_free_sized)(void*, size_t);                 /* Optional, NULL if the allocator has none */
+void (*imms_free_aligned_sized)(void*, size_t, size_t); /* Optional, NULL if the allocator has none */
 void* (*imms_memalign)(size_t, size_t);
+void* (*imms_calloc)(size_t, size_t);
 int (*imms_mallopt)(int, int);
 size_t (*imms_malloc_usable_size)(void*);
 int (*imms_pthread_create)(pthread_t*, const pthread_attr_t*, void *(*)(void*), void*);
 void (*imms_pthread_exit)(void*);
 imms_library_t imms_loaded_malloc_lib;
+imms_malloc_funcs_t imms_malloc_funcs[IMMS_MALLOC_LIB_MAX];
+static unsigned int numa_arena[IMMS_MALLOC_LIB_MAX][IMMS_NUMA_NODES_MAX];  /* The arena of a node + 1, zero if it has none */
 
 
 /****************************************************************************************/
 /****************************************************************************************/
 /****************************************************************************************/
 
-/* System Malloc */
+/* jemalloc style sized deallocation */
 
 /****************************************************************************************/
 
-static bool load_system()
+static void (*sdallocx)(void*, size_t, int);
+
+static void sdallocx_free_sized(void *ptr, size_t size)
+{
+    sdallocx(ptr, size, 0);
+}
+
+static void sdallocx_free_aligned_sized(void *ptr, size_t alignment, size_t size)
 {
-	imms_malloc = dlsym(RTLD_NEXT, "malloc");
-    imms_realloc = dlsym(RTLD_NEXT, "realloc");
-    imms_free = dlsym(RTLD_NEXT, "free");
-    imms_memalign = dlsym(RTLD_NEXT, "memalign");
-    imms_mallopt = dlsym(RTLD_NEXT, "mallopt");
-    imms_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
-	imms_pthread_create = NULL;
-	imms_pthread_exit = NULL;
-
-	return true;
+    /* MALLOCX_ALIGN(alignment) is the base 2 logarithm of the alignment */
+    sdallocx(ptr, size, __builtin_ctzl(alignment));
 }
 
 
@@ -59,192 +65,422 @@ static bool load_system()
 /****************************************************************************************/
 /****************************************************************************************/
 
-/* Hoard */
+/* IMMS Memory Allocator Library Functions */
 
 /****************************************************************************************/
 
-static bool load_hoard()
+/* Resolve the functions of a registry entry; the system allocator's are the next ones after IMMS */
+static bool load_malloc(const imms_malloc_lib_t *ml, imms_malloc_funcs_t *mf)
 {
-    void *handle;
-
-    handle = dlopen(IMMS_MALLOC_LIB_PATH "libhoard.so", DL_FLAGS);
-	imms_malloc = dlsym(handle, "hoard_malloc");
-	imms_realloc = dlsym(handle, "hoard_realloc");
-	imms_free = dlsym(handle, "hoard_free");
-	imms_memalign = dlsym(handle, "hoard_memalign");
-	imms_mallopt = dlsym(handle, "hoard_mallopt");
-	imms_malloc_usable_size = dlsym(handle, "hoard_malloc_usable_size");
-	imms_pthread_create = dlsym(handle, "hoard_pthread_create");
-	imms_pthread_exit = dlsym(handle, "hoard_pthread_exit");
-	if (!imms_malloc || !imms_realloc || !imms_free || !imms_memalign ||
-        !imms_mallopt || !imms_malloc_usable_size || !imms_pthread_create || !imms_pthread_exit) {
-        imms_log_error("load_hoard error!");
-        return false;
+    char filepath[PATH_MAX + 1];
+    void *handle, *sym[IMMS_MALLOC_SYM_END];
+    unsigned int i;
+
+    if (!strcmp(ml->file, "-")) {
+        handle = RTLD_NEXT;
+    } else {
+        snprintf(filepath, sizeof(filepath), "%s%s", IMMS_MALLOC_LIB_PATH, ml->file);
+        if (!(handle = dlopen(filepath, DL_FLAGS))) {
+            imms_log_error("load_malloc dlopen error!");
+            imms_log_error(filepath);
+            return false;
+        }
+    }
+    for (i = 0; i < IMMS_MALLOC_SYM_END; i++) {
+        sym[i] = *ml->sym[i] ? dlsym(handle, ml->sym[i]) : NULL;
+        if (!sym[i] && (ml->required & (1 << i))) {
+            imms_log_error("load_malloc missing function!");
+            imms_log_error(ml->name);
+            imms_log_error(ml->sym[i]);
+            return false;
+        }
     }
+    mf->realloc = sym[IMMS_MALLOC_SYM_REALLOC];
+    mf->free = sym[IMMS_MALLOC_SYM_FREE];
+    mf->memalign = sym[IMMS_MALLOC_SYM_MEMALIGN];
+    mf->calloc = sym[IMMS_MALLOC_SYM_CALLOC];
+    mf->malloc_usable_size = sym[IMMS_MALLOC_SYM_USABLE_SIZE];
+    mf->mallopt = sym[IMMS_MALLOC_SYM_MALLOPT];
+    mf->free_sized = sym[IMMS_MALLOC_SYM_FREE_SIZED];
+    mf->free_aligned_sized = sym[IMMS_MALLOC_SYM_FREE_ALIGNED_SIZED];
+    mf->mallctl = sym[IMMS_MALLOC_SYM_MALLCTL];
+    mf->set_property = sym[IMMS_MALLOC_SYM_SET_PROPERTY];
+    mf->get_property = sym[IMMS_MALLOC_SYM_GET_PROPERTY];
+    mf->mallinfo2 = sym[IMMS_MALLOC_SYM_MALLINFO2];
+    /* The wrappers serve one sdallocx; other allocators exporting it fall back to free */
+    if (sym[IMMS_MALLOC_SYM_SDALLOCX] && (!sdallocx || sdallocx == sym[IMMS_MALLOC_SYM_SDALLOCX])) {
+        sdallocx = sym[IMMS_MALLOC_SYM_SDALLOCX];
+        if (!mf->free_sized)
+            mf->free_sized = sdallocx_free_sized;
+        if (!mf->free_aligned_sized)
+            mf->free_aligned_sized = sdallocx_free_aligned_sized;
+    }
+    if (!imms_pthread_create)
+        imms_pthread_create = sym[IMMS_MALLOC_SYM_PTHREAD_CREATE];
+    if (!imms_pthread_exit)
+        imms_pthread_exit = sym[IMMS_MALLOC_SYM_PTHREAD_EXIT];
+    if (sym[IMMS_MALLOC_SYM_INIT])
+        ((void (*)())sym[IMMS_MALLOC_SYM_INIT])();
+    /* malloc is set last, it tells that the table is complete */
+    __atomic_store_n(&mf->malloc, sym[IMMS_MALLOC_SYM_MALLOC], __ATOMIC_RELEASE);
 
     return true;
 }
 
+bool imms_load_malloc_funcs(imms_library_t lib)
+{
+    if (lib >= imms_malloc_lib_count)
+        return false;
+    if (imms_malloc_funcs[lib].malloc)
+        return true;
 
-/****************************************************************************************/
-/****************************************************************************************/
-/****************************************************************************************/
+    return load_malloc(&imms_malloc_libs[lib], &imms_malloc_funcs[lib]);
+}
 
-/* TCMalloc */
+/* mallctl wants the exact size of the setting, which is found by reading it */
+static bool tune_mallctl(int (*mallctl)(const char*, void*, size_t*, void*, size_t), const char *name, long value)
+{
+    static const size_t sizes[] = { sizeof(long), sizeof(int), sizeof(bool) };
+    union {
+        long l;
+        int i;
+        bool b;
+    } v;
+    size_t len;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        len = sizes[i];
+        if (!mallctl(name, &v, &len, NULL, 0) && len == sizes[i])
+            break;
+    }
+    if (i == sizeof(sizes) / sizeof(sizes[0]))
+        return false;
+    if (sizeof(long) == len)
+        v.l = value;
+    else if (sizeof(int) == len)
+        v.i = value;
+    else
+        v.b = value != 0;
+
+    return !mallctl(name, NULL, NULL, &v, len);
+}
 
-/****************************************************************************************/
+static bool stats_mallctl(const imms_malloc_funcs_t *mf, const char *name, size_t *value)
+{
+    size_t len = sizeof(*value);
 
-static bool load_tcmalloc()
+    return !mf->mallctl(name, value, &len, NULL, 0);
+}
+
+/* Reads the statistics of an allocator through jemalloc's mallctl, tcmalloc's properties or glibc's mallinfo2; false if it has none */
+static bool malloc_lib_stats(imms_library_t lib, imms_malloc_stats_t *stats)
 {
-    void *handle;
-
-    handle = dlopen(IMMS_MALLOC_LIB_PATH "libtcmalloc_minimal.so", DL_FLAGS);
-	imms_malloc = dlsym(handle, "tc_malloc");
-	imms_realloc = dlsym(handle, "tc_realloc");
-	imms_free = dlsym(handle, "tc_free");
-	imms_memalign = dlsym(handle, "tc_memalign");
-	imms_mallopt = dlsym(handle, "tc_mallopt");
-	imms_malloc_usable_size = dlsym(handle, "tc_malloc_size");
-	imms_pthread_create = NULL;
-	imms_pthread_exit = NULL;
-	if (!imms_malloc || !imms_realloc || !imms_free || !imms_memalign ||
-        !imms_mallopt || !imms_malloc_usable_size) {
-        imms_log_error("load_tcmalloc error!");
-        return false;
+    const imms_malloc_funcs_t *mf = &imms_malloc_funcs[lib];
+    size_t heap, pagefree, unmapped;
+    imms_mallinfo2_t mi;
+    uint64_t epoch = 1;
+    size_t len = sizeof(epoch);
+
+    memset(stats, 0, sizeof(*stats));
+    if (mf->mallctl) {
+        /* The statistics are cached until the epoch advances */
+        mf->mallctl("epoch", &epoch, &len, &epoch, len);
+        if (!stats_mallctl(mf, "stats.allocated", &stats->allocated) || !stats_mallctl(mf, "stats.active", &stats->active))
+            return false;
+        stats_mallctl(mf, "stats.resident", &stats->resident);
+        stats_mallctl(mf, "stats.retained", &stats->retained);
+        stats_mallctl(mf, "stats.metadata", &stats->metadata);
+        return true;
+    }
+    if (mf->get_property) {
+        if (mf->get_property("generic.current_allocated_bytes", &stats->allocated) != 1 ||
+            mf->get_property("generic.heap_size", &heap) != 1)
+            return false;
+        if (mf->get_property("tcmalloc.pageheap_free_bytes", &pagefree) != 1)
+            pagefree = 0;
+        if (mf->get_property("tcmalloc.pageheap_unmapped_bytes", &unmapped) != 1)
+            unmapped = 0;
+        stats->active = heap - pagefree - unmapped;
+        stats->resident = heap - unmapped;
+        stats->retained = unmapped;
+        if (mf->get_property("generic.total_physical_bytes", &heap) == 1 && heap > stats->resident)
+            stats->metadata = heap - stats->resident;
+        return true;
+    }
+    if (mf->mallinfo2) {
+        mi = mf->mallinfo2();
+        stats->allocated = mi.uordblks + mi.hblkhd;
+        stats->active = mi.arena - mi.fordblks + mi.hblkhd;
+        stats->resident = mi.arena + mi.hblkhd;
+        return true;
     }
 
-    return true;
+    return false;
 }
 
+/*
+ * Sums the statistics of every allocator the process has loaded, since blocks of the previous
+ * ones live on after a swap; entries of the same file are one allocator. False if one of them
+ * has no statistics.
+ */
+bool imms_malloc_stats(imms_malloc_stats_t *stats)
+{
+    imms_malloc_stats_t lib_stats;
+    unsigned int i, j;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < imms_malloc_lib_count; i++) {
+        if (!imms_malloc_funcs[i].malloc)
+            continue;
+        for (j = 0; j < i && (!imms_malloc_funcs[j].malloc || strcmp(imms_malloc_libs[j].file, imms_malloc_libs[i].file)); j++);
+        if (j < i)
+            continue;
+        if (!malloc_lib_stats(i, &lib_stats))
+            return false;
+        stats->allocated += lib_stats.allocated;
+        stats->active += lib_stats.active;
+        stats->resident += lib_stats.resident;
+        stats->retained += lib_stats.retained;
+        stats->metadata += lib_stats.metadata;
+    }
 
-/****************************************************************************************/
-/****************************************************************************************/
-/****************************************************************************************/
+    return true;
+}
 
-/* JEMalloc */
+/*
+ * Gives the allocator an arena per node once, see numa= in registry.c.
+ * An error is not retried, arenas already created stay bound to their node.
+ */
+static void numa_create_arenas(imms_library_t lib)
+{
+    static int once[IMMS_MALLOC_LIB_MAX];
+    const imms_numa_t *numa = imms_numa_topology();
+    const imms_malloc_funcs_t *mf = &imms_malloc_funcs[lib];
+    unsigned int i, arena;
+    size_t len;
+
+    if (!numa || numa->nnodes < 2 || !imms_once(&once[lib]))
+        return;
+    if (!mf->mallctl) {
+        imms_log_error("numa_create_arenas allocator has no mallctl!");
+        imms_log_error(imms_malloc_libs[lib].name);
+        goto done;
+    }
+    for (i = 0; i < numa->nnodes; i++) {
+        len = sizeof(arena);
+        if (mf->mallctl("arenas.create", &arena, &len, NULL, 0)) {
+            imms_log_error("numa_create_arenas arenas.create error!");
+            goto done;
+        }
+        __atomic_store_n(&numa_arena[lib][numa->node[i]], arena + 1, __ATOMIC_RELEASE);
+    }
 
-/****************************************************************************************/
+done:
+    imms_once_done(&once[lib]);
+}
 
-static bool load_jemalloc()
+/* Binds the calling thread to the arena of the node it runs on, if the allocator in use has arenas per node */
+void imms_numa_bind_thread()
 {
-    void *handle;
-
-    handle = dlopen(IMMS_MALLOC_LIB_PATH "libjemalloc.so", DL_FLAGS);
-	imms_malloc = dlsym(handle, "je_malloc");
-	imms_realloc = dlsym(handle, "je_realloc");
-	imms_free = dlsym(handle, "je_free");
-	imms_memalign = dlsym(handle, "je_memalign");
-	imms_mallopt = NULL;
-	imms_malloc_usable_size = dlsym(handle, "je_malloc_usable_size");
-	imms_pthread_create = NULL;
-	imms_pthread_exit = NULL;
-	if (!imms_malloc || !imms_realloc || !imms_free || !imms_memalign ||
-        !imms_malloc_usable_size) {
-        imms_log_error("load_jemalloc error!");
+    imms_library_t lib = imms_loaded_malloc_lib;
+    const imms_numa_t *numa;
+    unsigned int arena;
+    int cpu;
+
+    if (!(imms_malloc_libs[lib].flags & IMMS_MALLOC_NUMA_ARENAS) || !(numa = imms_numa_topology()) ||
+        (cpu = sched_getcpu()) < 0 || cpu >= IMMS_NUMA_CPUS_MAX ||
+        !(arena = __atomic_load_n(&numa_arena[lib][numa->cpu_node[cpu]], __ATOMIC_ACQUIRE)))
+        return;
+    arena--;
+    if (imms_malloc_funcs[lib].mallctl("thread.arena", NULL, NULL, &arena, sizeof(arena)))
+        imms_log_error("imms_numa_bind_thread thread.arena error!");
+}
+
+/* Whether the tunables of the entries are the same settings, whatever their values */
+static bool malloc_same_tunables(const imms_malloc_lib_t *a, const imms_malloc_lib_t *b)
+{
+    unsigned int i, j;
+
+    if (a->ntunables != b->ntunables)
         return false;
+    for (i = 0; i < a->ntunables; i++) {
+        for (j = 0; j < b->ntunables; j++) {
+            if (a->tunables[i].kind == b->tunables[j].kind &&
+                (IMMS_MALLOC_TUNE_MALLOPT == a->tunables[i].kind ? a->tunables[i].param == b->tunables[j].param :
+                 !strcmp(a->tunables[i].name, b->tunables[j].name)))
+                break;
+        }
+        if (j == b->ntunables)
+            return false;
     }
 
-	return true;
+    return true;
 }
 
+/* Entries of the same file share its settings, which would outlive a swap to lib unless it sets them all again */
+bool imms_malloc_lib_swappable(imms_library_t lib)
+{
+    unsigned int i;
 
-/****************************************************************************************/
-/****************************************************************************************/
-/****************************************************************************************/
+    for (i = 0; i < imms_malloc_lib_count; i++) {
+        if (i != lib && imms_malloc_funcs[i].malloc && !strcmp(imms_malloc_libs[i].file, imms_malloc_libs[lib].file) &&
+            !malloc_same_tunables(&imms_malloc_libs[i], &imms_malloc_libs[lib]))
+            return false;
+    }
 
-/* IMMS Memory Allocator Library Functions */
+    return true;
+}
 
-/****************************************************************************************/
+/* Applies the tunables of the registry entry, then the mallopt parameters of the policy */
+void imms_apply_malloc_tunables(imms_library_t lib)
+{
+    const imms_malloc_lib_t *ml = &imms_malloc_libs[lib];
+    const imms_malloc_funcs_t *mf = &imms_malloc_funcs[lib];
+    const imms_malloc_tunable_t *t;
+    const imms_policy_rule_t *rule;
+    char *procfilepath;
+    unsigned int i;
+    bool ok;
+
+    for (i = 0; i < ml->ntunables; i++) {
+        t = &ml->tunables[i];
+        if (IMMS_MALLOC_TUNE_MALLOPT == t->kind)
+            ok = mf->mallopt && mf->mallopt(t->param, t->value);
+        else if (IMMS_MALLOC_TUNE_MALLCTL == t->kind)
+            ok = mf->mallctl && tune_mallctl(mf->mallctl, t->name, t->value);
+        else
+            ok = mf->set_property && mf->set_property(t->name, t->value);
+        if (!ok) {
+            imms_log_error("imms_apply_malloc_tunables tunable error!");
+            imms_log_error(ml->name);
+            imms_log_error(t->name);
+        }
+    }
+    if (ml->flags & IMMS_MALLOC_NUMA_ARENAS)
+        numa_create_arenas(lib);
+    if (!mf->mallopt || !(procfilepath = imms_process_filepath()) || !(rule = imms_policy_lookup(procfilepath)))
+        return;
+    for (i = 0; i < rule->ntunables; i++) {
+        if (!mf->mallopt(rule->tunables[i].param, rule->tunables[i].value))
+            imms_log_error("imms_apply_malloc_tunables mallopt error!");
+    }
+}
+
+/* Chooses the allocator for the process from the policy and the perf-res index; without a record, the system allocator is tested */
+int imms_select_malloc_lib(const char *procfilepath, bool *perf_test_mode)
+{
+    static imms_perf_res_entry_t entry;
+    const imms_policy_rule_t *rule = imms_policy_lookup(procfilepath);
+    bool explore = !rule || !(rule->flags & IMMS_POLICY_NO_EXPLORE);
+    const char *name, *key;
+    int reglib;
+
+    *perf_test_mode = false;
+    if (rule && *rule->pin) {
+        if ((reglib = imms_find_malloc_lib(rule->pin)) != -1)
+            return reglib;
+        imms_log_error("imms_select_malloc_lib pinned allocator is not in the registry!");
+    }
+    /* The record is the one of the workload, which may be narrower than the binary */
+    if (!(key = imms_process_key()) || !imms_perf_res_lookup(key, &entry)) {
+        IMMS_VERBOSE_MSG("imms_select_malloc_lib no perf-res record");
+        *perf_test_mode = explore;
+        return IMMS_MALLOC_SYSTEM;
+    }
+    *perf_test_mode = entry.test_mode && explore;
+    if (*perf_test_mode) {
+        name = entry.lib[3];
+    } else if (!strcmp(entry.lib[0], entry.lib[1]) && !strcmp(entry.lib[1], entry.lib[2])) {
+        name = entry.lib[0];
+    } else {
+        imms_budget_t budget;
+        size_t need[3];
+        bool busy;
+        int i;
+
+        name = entry.lib[2];
+        /* The peak is what has to fit; records which didn't track it have the mean */
+        for (i = 0; i < 3; i++)
+            need[i] = entry.peakmem[i] ? entry.peakmem[i] : entry.avgmem[i];
+        if (imms_read_budget(&budget)) {
+            busy = budget.cpu_pressure >= 0 ? budget.cpu_pressure >= SELECT_PRESSURE : budget.cpu_load >= SELECT_CPU_LOAD;
+            if (budget.mem_free < need[2] || budget.mem_pressure >= SELECT_PRESSURE)
+                name = entry.lib[1];
+            else if (busy && budget.mem_free >= need[0])
+                name = entry.lib[0];
+        } else {
+            imms_log_error("imms_select_malloc_lib imms_read_budget error!");
+        }
+    }
+    /* The library may have been removed from the registry */
+    if ((reglib = imms_find_malloc_lib(name)) == -1) {
+        reglib = IMMS_MALLOC_SYSTEM;
+        *perf_test_mode = false;
+    }
 
-/* if you change this array, accordingly change imms_malloc_lib_names array in util.c */
-static bool (*load_malloc[])() = {
-    load_system,
-    load_hoard,
-    load_tcmalloc,
-    load_jemalloc
-};
+    return reglib;
+}
 
 void imms_load_malloc_lib()
 {
-    imms_perf_result_t perfres;
-    char filepath[PATH_MAX + 1], *procfilepath;
-    int fd;
-    imms_library_t lib = 0;
-    bool perf_test_mode = false;
+    const imms_policy_rule_t *rule;
+    char *procfilepath;
+    imms_library_t lib = IMMS_MALLOC_SYSTEM;
+    imms_malloc_funcs_t *mf;
+    bool perf_test_mode = false, excluded = true;
 
     imms_perf_test_mode = false;
+    imms_load_malloc_registry();
     if (!(procfilepath = imms_process_filepath())) {
         IMMS_VERBOSE_MSG("imms_load_malloc_lib imms_process_filepath error!");
-        goto errret;
-    }
-    if (imms_is_process_excluded())
-        goto errret;
-    perf_test_mode = true;
-    strcpy(filepath, procfilepath);
-    if (!imms_open_perf_log_file(filepath, sizeof(filepath), IMMS_PERF_RES_PATH)) {
-        IMMS_VERBOSE_MSG("imms_load_malloc_lib imms_open_perf_log_file error!");
-        goto errret;
-    }
-    fd = open(filepath, O_RDONLY);
-    if (-1 == fd) {
-        imms_log_error("imms_load_malloc_lib open error!");
-        imms_log_error(filepath);
-        goto errret;
-    }
-    lseek(fd, strlen(procfilepath) + 1, SEEK_SET);
-    if (read(fd, &perfres, sizeof(perfres)) != sizeof(perfres)) {
-        imms_log_error("imms_load_malloc_lib read error!");
-    } else {
-        perf_test_mode = perfres.test_mode;
-        if (perf_test_mode) {
-            lib = perfres.nextlib;
-        } else if (perfres.result[0] == perfres.result[1] && perfres.result[1] == perfres.result[2]) {
-            lib = perfres.result[0];
-        } else {
-            struct sysinfo info;
-            double cpuload;
-            size_t freeram;
-
-            if (!sysinfo(&info)) {
-                cpuload = info.loads[1] / 65536.0;      /* Inspect 5-minute CPU load */
-                freeram = info.freeram * info.mem_unit;
-                if (cpuload >= 0.75 && freeram >= perfres.smr[perfres.result[0]].avgmem)
-                    lib = perfres.result[0];
-                else if (freeram < perfres.smr[perfres.result[1]].avgmem && cpuload < 0.75)
-                    lib = perfres.result[1];
-                else
-                    lib = perfres.result[2];
-            } else {
-                imms_log_error("imms_load_malloc_lib sysinfo error!");
-            }
-        }
+    } else if (!(excluded = imms_is_process_excluded())) {
+        lib = imms_select_malloc_lib(procfilepath, &perf_test_mode);
     }
-    close(fd);
-
-errret:
-    if (lib > IMMS_MALLOC_LIB_END)
-        lib = 0;
+    if (lib >= imms_malloc_lib_count)
+        lib = IMMS_MALLOC_SYSTEM;
     //lib = 1;      /* For testing */
-    if (!load_malloc[lib]()) {
-        load_system();
-        lib = 0;
+    if (!imms_load_malloc_funcs(lib)) {
+        imms_load_malloc_funcs(IMMS_MALLOC_SYSTEM);
+        lib = IMMS_MALLOC_SYSTEM;
         perf_test_mode = false;
     }
+    if (!excluded)
+        imms_apply_malloc_tunables(lib);
+    mf = &imms_malloc_funcs[lib];
+    imms_malloc = mf->malloc;
+    imms_realloc = mf->realloc;
+    imms_free = mf->free;
+    imms_free_sized = mf->free_sized;
+    imms_free_aligned_sized = mf->free_aligned_sized;
+    imms_memalign = mf->memalign;
+    imms_calloc = mf->calloc;
+    imms_mallopt = mf->mallopt;
+    imms_malloc_usable_size = mf->malloc_usable_size;
     if (!imms_pthread_create)
         imms_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
     if (!imms_pthread_exit)
         imms_pthread_exit = dlsym(RTLD_NEXT, "pthread_exit");
 	imms_loaded_malloc_lib = lib;
-	imms_share_info(imms_loaded_malloc_lib, perf_test_mode);
-	if (perf_test_mode) {
-        imms_perf_init();
-        imms_perf_test_mode = true;
-	}
+    /* Threads started later are bound as they start */
+    if (!excluded)
+        imms_numa_bind_thread();
+#ifdef IMMS_HOT_SWAP
+	/* immsd tells through the shared file when to swap, which the processes not under test map only if their rule asks for it */
+	if (perf_test_mode || (!excluded && procfilepath && (rule = imms_policy_lookup(procfilepath)) && (rule->flags & IMMS_POLICY_HOT_SWAP)))
+        imms_perf_init(perf_test_mode);
+#else
+	if (perf_test_mode)
+        imms_perf_init(perf_test_mode);
+#endif
 	IMMS_VERBOSE_MSGWPTR("imms_loaded_malloc_lib =", imms_loaded_malloc_lib);
 	IMMS_VERBOSE_MSGWPTR("imms_malloc =", imms_malloc);
     IMMS_VERBOSE_MSGWPTR("imms_realloc =", imms_realloc);
     IMMS_VERBOSE_MSGWPTR("imms_free =", imms_free);
+    IMMS_VERBOSE_MSGWPTR("imms_free_sized =", imms_free_sized);
+    IMMS_VERBOSE_MSGWPTR("imms_free_aligned_sized =", imms_free_aligned_sized);
     IMMS_VERBOSE_MSGWPTR("imms_memalign =", imms_memalign);
+    IMMS_VERBOSE_MSGWPTR("imms_calloc =", imms_calloc);
     IMMS_VERBOSE_MSGWPTR("imms_mallopt =", imms_mallopt);
     IMMS_VERBOSE_MSGWPTR("imms_malloc_usable_size =", imms_malloc_usable_size);
     IMMS_VERBOSE_MSGWPTR("imms_pthread_create =", imms_pthread_create);
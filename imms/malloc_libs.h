@@ -17,22 +17,138 @@
  * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define IMMS_MALLOC_SYSTEM      0
-#define IMMS_MALLOC_HOARD       1
-#define IMMS_MALLOC_TC          2
-#define IMMS_MALLOC_JE          3
-#define IMMS_MALLOC_LIB_END     3
+#define IMMS_MALLOC_SYSTEM          0       /* Always the first entry of the registry */
+#define IMMS_MALLOC_LIB_MAX         16
+#define IMMS_MALLOC_LIB_NAME_MAX    32
+#define IMMS_MALLOC_LIB_FILE_MAX    128
+#define IMMS_MALLOC_SYM_MAX         64
+
+/* Functions an allocator declares in the registry */
+#define IMMS_MALLOC_SYM_MALLOC              0
+#define IMMS_MALLOC_SYM_REALLOC             1
+#define IMMS_MALLOC_SYM_FREE                2
+#define IMMS_MALLOC_SYM_MEMALIGN            3
+#define IMMS_MALLOC_SYM_CALLOC              4
+#define IMMS_MALLOC_SYM_USABLE_SIZE         5
+#define IMMS_MALLOC_SYM_MALLOPT             6
+#define IMMS_MALLOC_SYM_FREE_SIZED          7
+#define IMMS_MALLOC_SYM_FREE_ALIGNED_SIZED  8
+#define IMMS_MALLOC_SYM_SDALLOCX            9
+#define IMMS_MALLOC_SYM_PTHREAD_CREATE      10
+#define IMMS_MALLOC_SYM_PTHREAD_EXIT        11
+#define IMMS_MALLOC_SYM_INIT                12
+#define IMMS_MALLOC_SYM_MALLCTL             13      /* jemalloc style */
+#define IMMS_MALLOC_SYM_SET_PROPERTY        14      /* MallocExtension_SetNumericProperty of tcmalloc */
+#define IMMS_MALLOC_SYM_GET_PROPERTY        15      /* MallocExtension_GetNumericProperty of tcmalloc */
+#define IMMS_MALLOC_SYM_MALLINFO2           16      /* glibc */
+#define IMMS_MALLOC_SYM_END                 17
+#define IMMS_MALLOC_SYM_REQUIRED            0x3f    /* malloc to malloc_usable_size */
+
+#define IMMS_MALLOC_TUNABLES_MAX    8
+
+/* Kinds of tunables */
+#define IMMS_MALLOC_TUNE_MALLOPT        0
+#define IMMS_MALLOC_TUNE_MALLCTL        1
+#define IMMS_MALLOC_TUNE_PROPERTY       2
+
+#define IMMS_MALLOC_NUMA_ARENAS     0x1     /* An arena per NUMA node through mallctl, threads use the one of their node */
+
+#define IMMS_SWAP_POLL_CALLS        65536   /* Allocations of a thread between checks for a swap */
+
+typedef struct {
+    unsigned char kind;                         /* IMMS_MALLOC_TUNE_* */
+    int param;                                  /* mallopt */
+    char name[IMMS_MALLOC_SYM_MAX];             /* mallctl and property */
+    long value;
+} imms_malloc_tunable_t;
+
+typedef struct {
+    char name[IMMS_MALLOC_LIB_NAME_MAX];
+    char file[IMMS_MALLOC_LIB_FILE_MAX];        /* In IMMS_MALLOC_LIB_PATH, "-" for the system allocator */
+    char sym[IMMS_MALLOC_SYM_END][IMMS_MALLOC_SYM_MAX];
+    unsigned int required;                      /* Bit mask of IMMS_MALLOC_SYM_* */
+    unsigned int flags;                         /* IMMS_MALLOC_NUMA_ARENAS */
+    unsigned int ntunables;
+    imms_malloc_tunable_t tunables[IMMS_MALLOC_TUNABLES_MAX];
+} imms_malloc_lib_t;
+
+/* Statistics in bytes as the allocator itself reports them */
+typedef struct {
+    size_t allocated;       /* In allocated blocks */
+    size_t active;          /* In the pages of allocated blocks */
+    size_t resident;        /* Of the heap in memory */
+    size_t retained;        /* Mapped, but returned to the kernel */
+    size_t metadata;        /* Bookkeeping of the allocator */
+} imms_malloc_stats_t;
+
+/* The layout of struct mallinfo2 of glibc 2.33, which older headers lack */
+typedef struct {
+    size_t arena;
+    size_t ordblks;
+    size_t smblks;
+    size_t hblks;
+    size_t hblkhd;
+    size_t usmblks;
+    size_t fsmblks;
+    size_t uordblks;
+    size_t fordblks;
+    size_t keepcost;
+} imms_mallinfo2_t;
+
+/* Functions of a loaded allocator, kept per library so that pointers can go back to their owner after a swap */
+typedef struct {
+    void* (*malloc)(size_t);
+    void* (*realloc)(void*, size_t);
+    void (*free)(void*);
+    void (*free_sized)(void*, size_t);
+    void (*free_aligned_sized)(void*, size_t, size_t);
+    void* (*memalign)(size_t, size_t);
+    void* (*calloc)(size_t, size_t);
+    int (*mallopt)(int, int);
+    size_t (*malloc_usable_size)(void*);
+    int (*mallctl)(const char*, void*, size_t*, void*, size_t);
+    int (*set_property)(const char*, size_t);
+    int (*get_property)(const char*, size_t*);
+    imms_mallinfo2_t (*mallinfo2)(void);
+} imms_malloc_funcs_t;
 
 extern void* (*imms_malloc)(size_t);
 extern void* (*imms_realloc)(void*, size_t);
 extern void (*imms_free)(void*);
+extern void (*imms_free_sized)(void*, size_t);
+extern void (*imms_free_aligned_sized)(void*, size_t, size_t);
 extern void* (*imms_memalign)(size_t, size_t);
+extern void* (*imms_calloc)(size_t, size_t);
 extern int (*imms_mallopt)(int, int);
 extern size_t (*imms_malloc_usable_size)(void*);
 extern int (*imms_pthread_create)(pthread_t*, const pthread_attr_t*, void *(*)(void*), void*);
 extern void (*imms_pthread_exit)(void*);
-extern unsigned char imms_loaded_malloc_lib;
+extern imms_library_t imms_loaded_malloc_lib;
 
-extern const char *imms_malloc_lib_names[];
+extern imms_malloc_lib_t imms_malloc_libs[];
+extern unsigned int imms_malloc_lib_count;
+extern imms_malloc_funcs_t imms_malloc_funcs[];
 
 void imms_load_malloc_lib();
+bool imms_load_malloc_funcs(imms_library_t lib);
+int imms_select_malloc_lib(const char *procfilepath, bool *perf_test_mode);
+int imms_mallopt_param(const char *name);
+void imms_apply_malloc_tunables(imms_library_t lib);
+bool imms_malloc_lib_swappable(imms_library_t lib);
+bool imms_malloc_stats(imms_malloc_stats_t *stats);
+void imms_numa_bind_thread();
+bool imms_swap_malloc_lib(imms_library_t lib);
+void imms_swap_check();
+
+extern __thread unsigned int imms_swap_poll_countdown __attribute__((tls_model("initial-exec")));
+
+/* Allocations check now and then whether immsd wants the process to swap its allocator */
+static inline void imms_swap_poll()
+{
+#ifdef IMMS_HOT_SWAP
+    if (__builtin_expect(!imms_swap_poll_countdown--, 0))
+        imms_swap_check();
+#endif
+}
+void imms_load_malloc_registry();
+int imms_find_malloc_lib(const char *name);
@@ -18,97 +18,382 @@
  */
 
 #include "perf.h"
+#if defined(IMMS_PERF_TSC) && (defined(__x86_64__) || defined(__i386__))
+    #include <cpuid.h>
+#endif
 
-#define	PERF_LOG_PATH		IMMS_PATH "perf-logs/"
 #define SECTONANO           (1000000000)
-#define PERF_STAT_TIME      5         /* Write perf log every 5 seconds */
+#define PERF_CALIBRATE_NS   2000000   /* TSC is calibrated against CLOCK_MONOTONIC_RAW over 2 ms, see perf_nsec_per_tick */
+#define PERF_CALIBRATE_MIN_NS 20000   /* Below, the reads of both clocks are too close for their ratio */
+#define PERF_OVERHEAD_RUNS  256
 
 bool imms_perf_test_mode;
-static imms_perf_t perf[IMMS_PERF_ARRAY_SIZE];
-static size_t malloc_mem;
-static pthread_t imms_perf_stat_tid;
+unsigned char imms_perf_clock_source;
+imms_perf_shared_t *imms_perf_shared;
+__thread unsigned int imms_perf_sample_countdown __attribute__((tls_model("initial-exec")));
+static double perf_nsec_per_tick = 1;
+static bool perf_nsec_hinted;               /* perf_nsec_per_tick holds the base frequency until the calibration */
+static bool perf_calibrated = true;         /* perf_nsec_per_tick is final */
+static bool perf_calibrating;
+static struct timespec perf_calibrate_ts;   /* Taken along perf_calibrate_tick */
+static imms_perf_tick_t perf_calibrate_tick;
+static imms_perf_tick_t perf_clock_overhead;
+static imms_perf_tick_t perf_sample_overhead;
+static __thread imms_perf_slot_t *perf_slot __attribute__((tls_model("initial-exec")));
+static int perf_shared_fd = -1;
+static pthread_key_t perf_thread_key;
+static pthread_once_t perf_thread_once = PTHREAD_ONCE_INIT;
+static bool perf_thread_keyed;
+static const imms_numa_t *perf_numa;    /* Placements are recorded only with several nodes */
+static uintptr_t perf_page_mask;
 
-void imms_perf_process(struct timespec *start, struct timespec *end, unsigned char type, size_t allocated_size[])
+/* A thread started through pthread_create */
+typedef struct {
+    void *(*start_routine)(void*);
+    void *arg;
+    bool counted;               /* In threads_live, so it has to be uncounted when it ends */
+} perf_thread_t;
+
+/* Threads take slots round-robin; once there are more threads than slots, they share them */
+static inline imms_perf_slot_t* imms_perf_thread_slot()
+{
+    if (!perf_slot)
+        perf_slot = &imms_perf_shared->slots[__sync_fetch_and_add(&imms_perf_shared->slot_next, 1) % IMMS_PERF_SLOTS];
+
+    return perf_slot;
+}
+
+/* Keep the slowest calls; only calls slower than the fastest kept one take the lock, so it's rarely taken */
+static void imms_perf_slow_call(unsigned long nsec, unsigned char type, size_t allocated_size[])
+{
+    imms_perf_slow_call_t *slow = imms_perf_shared->slow;
+    unsigned int i, min;
+
+    while (__sync_lock_test_and_set(&imms_perf_shared->slow_lock, 1))
+        while (imms_perf_shared->slow_lock);
+    if (nsec > imms_perf_shared->slow_min) {
+        for (i = 1, min = 0; i < IMMS_PERF_SLOW_CALLS; i++) {
+            if (slow[i].nsec < slow[min].nsec)
+                min = i;
+        }
+        slow[min].nsec = nsec;
+        clock_gettime(CLOCK_REALTIME, &slow[min].time);
+        slow[min].size = allocated_size[IMMS_PERF_FREE == type ? 0 : 1];
+        slow[min].type = type;
+        for (i = 1, min = 0; i < IMMS_PERF_SLOW_CALLS; i++) {
+            if (slow[i].nsec < slow[min].nsec)
+                min = i;
+        }
+        __atomic_store_n(&imms_perf_shared->slow_min, slow[min].nsec, __ATOMIC_RELAXED);
+    }
+    __sync_lock_release(&imms_perf_shared->slow_lock);
+}
+
+/* Records where a timed allocation was made, immsd finds out where its page is */
+static void imms_perf_placement(const void *ptr)
+{
+    unsigned int i;
+    int cpu;
+
+    if ((cpu = sched_getcpu()) < 0 || cpu >= IMMS_NUMA_CPUS_MAX)
+        return;
+    i = __atomic_fetch_add(&imms_perf_shared->placement_next, 1, __ATOMIC_RELAXED) % IMMS_PERF_PLACEMENTS;
+    __atomic_store_n(&imms_perf_shared->placements[i], ((uintptr_t)ptr & ~perf_page_mask) | (perf_numa->cpu_node[cpu] + 1), __ATOMIC_RELAXED);
+}
+
+/*
+ * Nanoseconds per TSC tick. Without a frequency from CPUID, the ticks are measured against
+ * CLOCK_MONOTONIC_RAW from the time taken by imms_perf_clock_init up to the current call;
+ * the first call past PERF_CALIBRATE_NS fixes the ratio, so no call sleeps to calibrate.
+ */
+static double imms_perf_nsec_per_tick()
 {
     struct timespec ts;
-    typeof(ts.tv_sec) sec;
-
-    __sync_add_and_fetch(&malloc_mem, allocated_size[1] - allocated_size[0]);
-	ts.tv_sec = end->tv_sec - start->tv_sec;
-	ts.tv_nsec = end->tv_nsec - start->tv_nsec;
-	if (ts.tv_nsec < 0) {
-		ts.tv_sec--;
-		ts.tv_nsec += SECTONANO;
-	}
-	sec = perf[type].time.tv_nsec / SECTONANO;
-	ts.tv_sec += sec;
-	ts.tv_nsec -= sec * SECTONANO;
-	__sync_add_and_fetch(&perf[type].time.tv_sec, ts.tv_sec);
-	__sync_add_and_fetch(&perf[type].time.tv_nsec, ts.tv_nsec);
-	__sync_add_and_fetch(&perf[type].count, 1);
-}
-
-static void* imms_perf_stat(void *pdata)
-{
-    imms_avg_perf_t perf_avg[IMMS_PERF_ARRAY_SIZE];
-    imms_perf_t p;
-	unsigned int i;
-	off_t pos;
-	size_t real_mem;
-	int fd = -1;
-	char filepath[PATH_MAX + 1];
-
-    memset(perf_avg, 0, sizeof(perf_avg));
-start:
-    sleep(PERF_STAT_TIME);
-    if (!imms_make_log_file(IMMS_PERF_LOGS_PATH, filepath, sizeof(filepath), false)) {
-        imms_log_error("imms_perf_stat imms_make_log_file error!");
-        return NULL;
+    imms_perf_tick_t tick;
+    bool expected = false;
+    double ratio;
+    long nsec;
+
+    if (__builtin_expect(__atomic_load_n(&perf_calibrated, __ATOMIC_ACQUIRE), 1))
+        return perf_nsec_per_tick;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    tick = imms_perf_clock();
+    nsec = (ts.tv_sec - perf_calibrate_ts.tv_sec) * SECTONANO + (ts.tv_nsec - perf_calibrate_ts.tv_nsec);
+    if (tick <= perf_calibrate_tick || nsec <= 0 || (nsec < PERF_CALIBRATE_MIN_NS && perf_nsec_hinted))
+        return perf_nsec_per_tick;
+    ratio = (double)nsec / (tick - perf_calibrate_tick);
+    if (nsec >= PERF_CALIBRATE_NS && __atomic_compare_exchange_n(&perf_calibrating, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        perf_nsec_per_tick = ratio;
+        imms_perf_shared->sample_cost = (perf_sample_overhead + perf_clock_overhead) * ratio;
+        __atomic_store_n(&perf_calibrated, true, __ATOMIC_RELEASE);
     }
-    if ((fd = open(filepath, O_RDWR)) == -1 ||
-        flock(fd, LOCK_EX | LOCK_NB) == -1 ||
-        (pos = lseek(fd, 0, SEEK_END)) == -1 ||
-        write(fd, &imms_loaded_malloc_lib, sizeof(imms_loaded_malloc_lib)) != sizeof(imms_loaded_malloc_lib))
-        goto error;
-    pos += sizeof(imms_loaded_malloc_lib);
-	for (;;) {
-        if (lseek(fd, pos, SEEK_SET) == -1)
-            goto error;
-        for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++) {
-            p.time.tv_sec = __sync_lock_test_and_set(&perf[i].time.tv_sec, 0);
-            p.time.tv_nsec = __sync_lock_test_and_set(&perf[i].time.tv_nsec, 0);
-            p.count = __sync_lock_test_and_set(&perf[i].count, 0);
-            /* To prevent division by zero */
-            if (perf_avg[i].count || p.count) {
-                perf_avg[i].sec = imms_average_winc(perf_avg[i].sec, p.time.tv_sec + ((long double)p.time.tv_nsec / SECTONANO), perf_avg[i].count, p.count);
-                perf_avg[i].count += p.count;
+
+    return ratio;
+}
+
+void imms_perf_process(imms_perf_tick_t start, imms_perf_tick_t end, unsigned char type, size_t allocated_size[], const void *ptr)
+{
+    imms_perf_slot_t *slot = imms_perf_thread_slot();
+    imms_perf_size_t *size;
+    unsigned long nsec, rate = __atomic_load_n(&imms_perf_shared->sample_rate, __ATOMIC_RELAXED);
+
+    /* The cost of reading the clock itself is not the allocator's */
+    end -= start;
+    nsec = end > perf_clock_overhead ? (end - perf_clock_overhead) * imms_perf_nsec_per_tick() : 0;
+    /* Relaxed atomics are enough, the slot's cache line is only contended when threads share it */
+    __atomic_add_fetch(&slot->malloc_mem, (allocated_size[1] - allocated_size[0]) * rate, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->perf[type].nsec, nsec, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->perf[type].count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->perf[type].calls, rate, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->hist[type][imms_perf_hist_bucket(nsec)], rate, __ATOMIC_RELAXED);
+    /* free is classified by the size it releases, others by the size they return */
+    size = &slot->size[type][imms_perf_size_class(allocated_size[IMMS_PERF_FREE == type ? 0 : 1])];
+    __atomic_add_fetch(&size->calls, rate, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&size->nsec, nsec * rate, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&size->bytes, allocated_size[IMMS_PERF_FREE == type ? 0 : 1] * rate, __ATOMIC_RELAXED);
+    if (nsec > __atomic_load_n(&imms_perf_shared->slow_min, __ATOMIC_RELAXED))
+        imms_perf_slow_call(nsec, type, allocated_size);
+    if (perf_numa && ptr && IMMS_PERF_FREE != type)
+        imms_perf_placement(ptr);
+}
+
+/*
+ * Pick the clock source and measure the cost of a clock read. TSC ticks are converted with the
+ * frequency of CPUID leaf 0x15 if the CPU reports it, or else calibrated by the timed calls
+ * themselves, see imms_perf_nsec_per_tick; this runs inside an allocation, so it can't sleep.
+ */
+static void imms_perf_clock_init()
+{
+    imms_perf_tick_t start, end;
+    unsigned int i;
+
+    imms_perf_clock_source = IMMS_PERF_CLOCK_MONOTONIC;
+    perf_nsec_per_tick = 1;
+#if defined(IMMS_PERF_TSC) && (defined(__x86_64__) || defined(__i386__))
+    {
+        unsigned int eax, ebx, ecx, edx;
+
+        /* CPUID.80000007H:EDX[8] is the invariant TSC flag */
+        if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8))) {
+            imms_perf_clock_source = IMMS_PERF_CLOCK_TSC;
+            /* The TSC runs at the crystal clock ECX times EBX / EAX; hypervisors often leave it zero */
+            if (__get_cpuid(0x15, &eax, &ebx, &ecx, &edx) && eax && ebx && ecx) {
+                perf_nsec_per_tick = (double)SECTONANO * eax / ((double)ecx * ebx);
+            } else {
+                /* The base frequency of leaf 0x16 is close enough until the calibration is done */
+                if ((perf_nsec_hinted = __get_cpuid(0x16, &eax, &ebx, &ecx, &edx) && (eax & 0xffff)))
+                    perf_nsec_per_tick = 1000.0 / (eax & 0xffff);
+                clock_gettime(CLOCK_MONOTONIC_RAW, &perf_calibrate_ts);
+                perf_calibrate_tick = imms_perf_clock();
+                __atomic_store_n(&perf_calibrated, false, __ATOMIC_RELEASE);
             }
         }
-        if (write(fd, perf_avg, sizeof(perf_avg)) != sizeof(perf_avg))
+    }
+#endif
+    perf_clock_overhead = ~0UL;
+    for (i = 0; i < PERF_OVERHEAD_RUNS; i++) {
+        start = imms_perf_clock();
+        end = imms_perf_clock();
+        if (end - start < perf_clock_overhead)
+            perf_clock_overhead = end - start;
+    }
+}
+
+/* Measure what instrumenting a timed call costs: two clock reads and two usable size probes */
+static void imms_perf_sample_init()
+{
+    imms_perf_tick_t start, end, min = ~0UL;
+    unsigned int i;
+    void *ptr;
+
+    if (!imms_malloc || !imms_free || !(ptr = imms_malloc(1)))
+        return;
+    for (i = 0; i < PERF_OVERHEAD_RUNS; i++) {
+        start = imms_perf_clock();
+        imms_malloc_usable_size(ptr);
+        imms_malloc_usable_size(ptr);
+        end = imms_perf_clock();
+        if (end - start < min)
+            min = end - start;
+    }
+    imms_free(ptr);
+    perf_sample_overhead = min;
+    imms_perf_shared->sample_cost = (min + perf_clock_overhead) * perf_nsec_per_tick;
+}
+
+/* The clock is set up the first time testing is turned on, see imms_perf_clock_init */
+void imms_perf_set_test_mode(bool test_mode)
+{
+    static bool calibrated = false;
+
+    if (!imms_perf_shared)
+        return;
+    if (test_mode && !calibrated) {
+        imms_perf_clock_init();
+        imms_perf_sample_init();
+        calibrated = true;
+    }
+    imms_perf_test_mode = test_mode;
+}
+
+/* Publish the allocator and the test mode; immsd starts a new perf log when either changes */
+void imms_perf_set_lib(imms_library_t lib, bool test_mode)
+{
+    if (!imms_perf_shared)
+        return;
+    imms_perf_set_test_mode(test_mode);
+    /* immsd takes the source of the allocated memory for a whole log when it sees the new allocator */
+    __atomic_store_n(&imms_perf_shared->stats_native, imms_malloc_stats(&imms_perf_shared->stats), __ATOMIC_RELEASE);
+    strncpy(imms_perf_shared->lib, imms_malloc_libs[lib].name, IMMS_MALLOC_LIB_NAME_MAX - 1);
+    imms_perf_shared->test_mode = test_mode;
+    imms_perf_shared->since = time(NULL);
+}
+
+/* Answers a request of immsd for the statistics of the allocator; immsd goes on with its estimates if it has none */
+void imms_perf_publish_stats(unsigned int seq)
+{
+    imms_perf_shared_t *shared = imms_perf_shared;
+
+    if (!shared)
+        return;
+    __atomic_store_n(&shared->stats_native, imms_malloc_stats(&shared->stats), __ATOMIC_RELEASE);
+    __atomic_store_n(&shared->stats_ack, seq, __ATOMIC_RELEASE);
+}
+
+/* The destructor of the key runs when a counted thread ends, whether it returned, exited or was cancelled */
+static void imms_perf_thread_end(void *value)
+{
+    if (imms_perf_shared)
+        __atomic_sub_fetch(&imms_perf_shared->threads_live, 1, __ATOMIC_RELAXED);
+}
+
+static void imms_perf_thread_key()
+{
+    perf_thread_keyed = !pthread_key_create(&perf_thread_key, imms_perf_thread_end);
+}
+
+static void* imms_perf_thread_start(void *p)
+{
+    perf_thread_t thread = *(perf_thread_t*)p;
+
+    imms_free(p);
+    if (thread.counted)
+        pthread_setspecific(perf_thread_key, (void*)1);
+    imms_numa_bind_thread();
+
+    return thread.start_routine(thread.arg);
+}
+
+/* Counts the running threads for immsd and binds them to the arena of their node; if it can't, the thread starts as it is */
+int imms_perf_thread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void*), void *arg)
+{
+    imms_perf_shared_t *shared = imms_perf_shared;
+    unsigned int live = 0, peak;
+    perf_thread_t *t;
+    int ret;
+
+    pthread_once(&perf_thread_once, imms_perf_thread_key);
+    if (!perf_thread_keyed || !(t = imms_malloc(sizeof(*t))))
+        return imms_pthread_create(thread, attr, start_routine, arg);
+    t->start_routine = start_routine;
+    t->arg = arg;
+    /* Counted before it starts, so that it can't end first */
+    if ((t->counted = shared != NULL))
+        live = __atomic_add_fetch(&shared->threads_live, 1, __ATOMIC_RELAXED);
+    if ((ret = imms_pthread_create(thread, attr, imms_perf_thread_start, t))) {
+        if (shared)
+            __atomic_sub_fetch(&shared->threads_live, 1, __ATOMIC_RELAXED);
+        imms_free(t);
+        return ret;
+    }
+    if (!shared)
+        return 0;
+    __atomic_add_fetch(&shared->threads_created, 1, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&shared->threads_peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&shared->threads_peak, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 0;
+}
+
+/* Maps a new shared file at addr, or anywhere if addr is NULL; the file gets its name once it is locked and filled in */
+static imms_perf_shared_t* imms_perf_share(void *addr)
+{
+    char tmppath[PATH_MAX + 1], path[PATH_MAX + 1], *key;
+    imms_perf_shared_t *shared;
+    unsigned int i;
+    int fd;
+
+    if (!(key = imms_process_key()))
+        return NULL;
+    /* Anyone can create files in IMMS_SHARED_PATH, so the file is created anew under a name nobody can guess */
+    snprintf(tmppath, sizeof(tmppath), "%s.%d.XXXXXX", IMMS_SHARED_PATH, getpid());
+    fd = mkostemp(tmppath, O_CLOEXEC);
+    if (-1 == fd)
+        return NULL;
+    if (fchmod(fd, 0644) == -1 || flock(fd, LOCK_EX) == -1 || ftruncate(fd, sizeof(imms_perf_shared_t)) == -1)
+        goto error;
+    shared = mmap(addr, sizeof(imms_perf_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | (addr ? MAP_FIXED : 0), fd, 0);
+    if (shared == MAP_FAILED)
+        goto error;
+    shared->pid = getpid();
+    strncpy(shared->path, key, PATH_MAX);
+    shared->sample_rate = 1;
+    shared->since = time(NULL);
+    /* A forked child runs only the thread which forked */
+    shared->threads_live = shared->threads_peak = 1;
+    __atomic_store_n(&shared->magic, IMMS_SHARED_MAGIC, __ATOMIC_RELEASE);
+    /* A pid reused by exec may still have a file which immsd hasn't collected yet */
+    for (i = 0; ; i++) {
+        snprintf(path, sizeof(path), "%s%d.%u", IMMS_SHARED_PATH, getpid(), i);
+        if (!link(tmppath, path))
+            break;
+        if (errno != EEXIST) {
+            munmap(shared, sizeof(imms_perf_shared_t));
             goto error;
-        if ((real_mem = imms_get_mem_usage(0, true)) && (lseek(fd, 0, SEEK_END) != -1)) {
-            if (write(fd, &malloc_mem, sizeof(malloc_mem)) != sizeof(malloc_mem) ||
-                write(fd, &real_mem, sizeof(real_mem)) != sizeof(real_mem))
-                goto error;
         }
-        sleep(PERF_STAT_TIME);
-	}
+    }
+    unlink(tmppath);
+    perf_shared_fd = fd;
+
+    return shared;
 
 error:
-    if (fd != -1)
-        close(fd);
-    unlink(filepath);
-    goto start;
+    close(fd);
+    unlink(tmppath);
+    return NULL;
+}
+
+/* The child gets its own file at the same address, so that the pointers into the parent's stay valid */
+static void imms_perf_atfork_child()
+{
+    char lib[IMMS_MALLOC_LIB_NAME_MAX];
+    bool test_mode;
+
+    if (!imms_perf_shared)
+        return;
+    memcpy(lib, imms_perf_shared->lib, sizeof(lib));
+    test_mode = imms_perf_shared->test_mode;
+    close(perf_shared_fd);
+    perf_shared_fd = -1;
+    if (!imms_perf_share(imms_perf_shared)) {
+        munmap(imms_perf_shared, sizeof(imms_perf_shared_t));
+        imms_perf_shared = NULL;
+        imms_perf_test_mode = false;
+        return;
+    }
+    memcpy(imms_perf_shared->lib, lib, sizeof(lib));
+    imms_perf_shared->test_mode = test_mode;
 }
 
-void imms_perf_init()
+void imms_perf_init(bool test_mode)
 {
-    if (!imms_pthread_create) {
-        imms_log_error("imms_perf_init imms_pthread_create is NULL!");
+    if (!(imms_perf_shared = imms_perf_share(NULL))) {
+        IMMS_VERBOSE_MSG("imms_perf_init imms_perf_share error!");
         return;
     }
-    malloc_mem = 0;
-    memset(perf, 0, sizeof(perf));
-    if (imms_pthread_create(&imms_perf_stat_tid, NULL, imms_perf_stat, NULL))
-		imms_log_error("imms_perf_init imms_pthread_create error!");
+    pthread_atfork(NULL, NULL, imms_perf_atfork_child);
+    perf_page_mask = sysconf(_SC_PAGESIZE) - 1;
+    if ((perf_numa = imms_numa_topology()) && perf_numa->nnodes < 2)
+        perf_numa = NULL;
+    imms_perf_set_lib(imms_loaded_malloc_lib, test_mode);
 }
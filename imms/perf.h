@@ -18,23 +18,52 @@
  */
 
 #include "imms.h"
+#include <stdint.h>
 
 #define	IMMS_PERF_MALLOC		0
 #define	IMMS_PERF_REALLOC		1
 #define	IMMS_PERF_MEMALIGN		2
 #define	IMMS_PERF_FREE			3
-#define IMMS_PERF_ARRAY_SIZE    4
+#define	IMMS_PERF_CALLOC		4
+#define IMMS_PERF_ARRAY_SIZE    5
 
-#define	IMMS_PERF_INIT(t)		struct timespec start, end; size_t allocated_size[2] = {0, 0}; const char type = t;
-#define	IMMS_PERF_BEGIN(ptr)	if (imms_perf_test_mode) { \
+#define IMMS_PERF_CLOCK_MONOTONIC   0
+#define IMMS_PERF_CLOCK_TSC         1
+
+#define IMMS_PERF_RES_MAGIC     0x524d4d49      /* "IMMR" */
+#define IMMS_SHARED_MAGIC       0x534d4d49      /* "IMMS" */
+#define IMMS_PERF_RES_VERSION   6
+#define IMMS_PERF_RES_INDEX_MAGIC   0x494d4d49  /* "IMMI" */
+#define IMMS_PERF_RES_INDEX_VERSION 4
+#define IMMS_PERF_RES_INDEX_SLOTS   4096        /* Power of two */
+#define IMMS_PERF_RES_INDEX         IMMS_PERF_RES_PATH "index"
+#define IMMS_PERF_RES_INDEX_TOMBSTONE 1         /* Hash of a removed entry, zero is an empty slot */
+
+#define IMMS_CACHE_LINE_SIZE    64
+#define IMMS_PERF_SLOTS         128     /* Per-thread counter slots, shared round-robin beyond this */
+#define IMMS_PERF_CPU_BUDGET    0.01    /* Instrumentation may use 1% of the process' CPU time */
+#define IMMS_PERF_SAMPLE_MAX    4096    /* Time at least 1 in IMMS_PERF_SAMPLE_MAX calls */
+#define IMMS_PERF_HIST_SUB_BITS 2       /* Latency histograms have 4 buckets per power of two nanoseconds */
+#define IMMS_PERF_HIST_BUCKETS  128     /* Up to 2^33 ns, slower calls go to the last bucket */
+#define IMMS_PERF_SLOW_CALLS    16      /* Slowest calls kept with their timestamps */
+#define IMMS_PERF_CONTENDED_NSEC 4096   /* A call slower than this left the fast path: it waited for a lock or the kernel */
+#define IMMS_PERF_PLACEMENTS    64      /* Timed allocations whose page immsd locates, on hosts with several NUMA nodes */
+#define IMMS_PERF_NUMA_NODES    8       /* Nodes a perf log counts the pages of, further nodes count as the last */
+#define IMMS_PERF_SIZE_CLASSES  24      /* Powers of two from 16 bytes to 64 MB, the last class is huge */
+#define IMMS_PERF_SIZE_BANDS    6       /* Size classes are grouped by four in a fingerprint */
+#define IMMS_PERF_FEATURES      (IMMS_PERF_SIZE_BANDS + 4)
+
+#define	IMMS_PERF_INIT(t)		imms_perf_tick_t start, end; bool timed = false; size_t allocated_size[2] = {0, 0}; const char type = t;
+#define	IMMS_PERF_BEGIN(ptr)	if (__builtin_expect(imms_perf_test_mode, 0) && imms_perf_sample()) { \
+                                    timed = true; \
                                     IMMS_VERBOSE_STD("IMMS_PERF_BEGIN", ptr); \
                                     if (ptr) { \
                                         allocated_size[0] = imms_malloc_usable_size(ptr); \
                                     } \
-                                    clock_gettime(CLOCK_REALTIME, &start); \
+                                    start = imms_perf_clock(); \
                                 }
-#define	IMMS_PERF_END(ptr)		if (imms_perf_test_mode) { \
-                                    clock_gettime(CLOCK_REALTIME, &end); \
+#define	IMMS_PERF_END(ptr)		if (timed) { \
+                                    end = imms_perf_clock(); \
                                     IMMS_VERBOSE_STD("IMMS_PERF_END", ptr); \
                                     if (!ptr && (IMMS_PERF_REALLOC == type)) allocated_size[0] = 0; \
                                     if (ptr) { \
@@ -42,19 +71,115 @@
                                     } \
                                     IMMS_VERBOSE_MSGWPTR("IMMS_PERF_END allocated_size[0]", allocated_size[0]); \
                                     IMMS_VERBOSE_MSGWPTR("IMMS_PERF_END allocated_size[1]", allocated_size[1]); \
-                                    imms_perf_process(&start, &end, type, allocated_size); \
+                                    imms_perf_process(start, end, type, allocated_size, ptr); \
                                 }
 
+typedef unsigned long imms_perf_tick_t;
+
 typedef struct {
-    struct timespec time;
-    unsigned int count;
+    unsigned long nsec;
+    unsigned long count;        /* Timed calls */
+    unsigned long calls;        /* Estimated calls, count scaled up by the sample rate */
 } imms_perf_t;
 
+/* Counters of a size class, scaled up by the sample rate */
+typedef struct {
+    unsigned long calls;
+    unsigned long nsec;
+    unsigned long bytes;
+} imms_perf_size_t;
+
+/* Counters of a thread, aligned to keep threads off each other's cache lines */
+typedef struct {
+    imms_perf_t perf[IMMS_PERF_ARRAY_SIZE];
+    size_t malloc_mem;
+    unsigned long hist[IMMS_PERF_ARRAY_SIZE][IMMS_PERF_HIST_BUCKETS];
+    imms_perf_size_t size[IMMS_PERF_ARRAY_SIZE][IMMS_PERF_SIZE_CLASSES];
+} __attribute__((aligned(IMMS_CACHE_LINE_SIZE))) imms_perf_slot_t;
+
+typedef struct {
+    unsigned long nsec;
+    struct timespec time;       /* CLOCK_REALTIME at the end of the call */
+    size_t size;
+    unsigned char type;
+} imms_perf_slow_call_t;
+
 typedef struct {
     double sec;
-    unsigned int count;
+    unsigned long count;
 } imms_avg_perf_t;
 
+/* Rewritten in place in the perf log every interval, memory samples are appended after it */
+typedef struct {
+    imms_avg_perf_t perf[IMMS_PERF_ARRAY_SIZE];
+    unsigned int sample_rate;
+    unsigned long hist[IMMS_PERF_ARRAY_SIZE][IMMS_PERF_HIST_BUCKETS];     /* Estimated calls since start */
+    imms_perf_slow_call_t slow[IMMS_PERF_SLOW_CALLS];                   /* Unused entries have zero nsec */
+    imms_perf_size_t size[IMMS_PERF_ARRAY_SIZE][IMMS_PERF_SIZE_CLASSES];  /* Since start */
+    unsigned int threads;                                               /* Threads which made a timed call */
+    unsigned int threads_live;                                          /* Threads running at the last interval */
+    unsigned int threads_peak;                                          /* Most threads running at once */
+    unsigned int threads_created;                                       /* Through pthread_create, since start */
+    unsigned long numa_pages[IMMS_PERF_NUMA_NODES];                     /* Located placements by the node of their page */
+    unsigned long numa_local;                                           /* Placements on the node of the allocating CPU */
+    unsigned long numa_remote;
+    imms_malloc_stats_t stats;                                          /* Of the allocator at the last interval, zero if it has none */
+} imms_perf_log_t;
+
+/* Performance summary of an allocator */
+typedef struct {
+    char name[IMMS_MALLOC_LIB_NAME_MAX];
+    double sec;
+    double memfrag;
+    double p99;                 /* 99th percentile latency of all operations */
+    double hist[IMMS_PERF_ARRAY_SIZE][IMMS_PERF_HIST_BUCKETS];    /* Merged latency histograms of all runs */
+    struct {
+        double calls;
+        double sec;
+        double bytes;
+    } size[IMMS_PERF_ARRAY_SIZE][IMMS_PERF_SIZE_CLASSES];            /* Totals of all runs per size class */
+    size_t avgmem;
+    size_t count;
+    time_t time;
+    double sec_m2;              /* Sums of squared differences from the mean of the runs, by Welford's method */
+    double memfrag_m2;
+    size_t nvar;                /* Runs in the sums, records of version 1 have none */
+    size_t peakmem;             /* Mean of the peaks of the runs, from version 4 */
+    double threads;             /* Mean of the most threads running at once in the runs, from version 5 */
+    double contention;          /* Mean share of the calls slower than IMMS_PERF_CONTENDED_NSEC */
+    double remote;              /* Mean share of the located placements off the node of the allocating CPU, from version 6 */
+} imms_perf_summary_t;
+
+/*
+ * A perf-res file holds the path of the binary on the first line, then the fields up to smr
+ * and nlibs summaries. Allocators are identified by name, result and nextlib index smr.
+ * The fingerprint describes the workload by the size mix of the allocations, the share of
+ * allocations among allocations and frees, the share of reallocations, the threads and the
+ * heap size, each scaled to [0, 1]; immsd predicts the allocators of unseen binaries from
+ * the binaries with the nearest fingerprints.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nlibs;
+    imms_library_t result[3], nextlib;
+    bool test_mode;
+    unsigned int fingerprinted;                 /* Runs averaged into fingerprint, from version 3 */
+    double fingerprint[IMMS_PERF_FEATURES];
+    imms_perf_summary_t smr[IMMS_MALLOC_LIB_MAX];
+} imms_perf_result_t;
+
+/* Records of version 1 and 2 have no fingerprint */
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nlibs;
+    imms_library_t result[3], nextlib;
+    bool test_mode;
+    imms_perf_summary_t smr[];
+} imms_perf_result_v2_t;
+
+/* Records written before the registry, summaries are indexed by the four built-in allocators */
 typedef struct {
     struct {
         double sec;
@@ -62,12 +187,159 @@ typedef struct {
         size_t avgmem;
         size_t count;
         time_t time;
-    } smr[IMMS_MALLOC_LIB_END + 1];     /* Performance summary */
+    } smr[4];
     imms_library_t result[3], nextlib;
     bool test_mode;
-} imms_perf_result_t;
+} imms_perf_result_v0_t;
+
+/*
+ * The choice of a perf-res record: the allocators of result and nextlib by name and the mean and
+ * peak memory the results used, and the fingerprint immsd predicts unseen binaries from. immsd
+ * updates it under a seqlock, seq is odd while it is being written.
+ */
+typedef struct {
+    unsigned int seq;
+    unsigned int file;          /* The record is in IMMS_PERF_RES_PATH<name>-<file> */
+    bool test_mode;
+    char lib[4][IMMS_MALLOC_LIB_NAME_MAX];     /* result[0..2], nextlib */
+    size_t avgmem[3];
+    size_t peakmem[3];
+    size_t nvar;                /* Runs of result[2] with a variance, the binary is tuned from MIN_TEST_AMOUNT */
+    unsigned int fingerprinted;
+    double fingerprint[IMMS_PERF_FEATURES];
+    char path[PATH_MAX + 1];
+} imms_perf_res_entry_t;
+
+/*
+ * IMMS_PERF_RES_INDEX maps the path of a binary to the choice of its record, so that a process
+ * starts with a lookup in a shared mapping. The slot is found by linear probing over hash; a
+ * hash without a matching path in its entry is a collision or an entry not written yet. A hash
+ * of IMMS_PERF_RES_INDEX_TOMBSTONE marks a removed entry, which the probing goes on past and
+ * which a new entry can take.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nslots;
+    uint64_t hash[IMMS_PERF_RES_INDEX_SLOTS];
+    imms_perf_res_entry_t entry[IMMS_PERF_RES_INDEX_SLOTS];
+} imms_perf_res_index_t;
+
+/*
+ * A process publishes its counters in a file of IMMS_SHARED_PATH named after its pid, which it
+ * keeps flocked while it runs. immsd maps it, samples the counters into perf logs and removes it
+ * once the lock is released. Fields marked immsd are written by immsd, the rest by the process.
+ */
+typedef struct {
+    unsigned int magic;         /* IMMS_SHARED_MAGIC once the rest of the header is filled */
+    pid_t pid;
+    char path[PATH_MAX + 1];    /* The key of the perf-res record, see imms_process_key */
+    char lib[IMMS_MALLOC_LIB_NAME_MAX];
+    bool test_mode;
+    unsigned int swap_seq;      /* immsd: bumped when the perf-res record of the process changed */
+    unsigned int swap_ack;      /* The swap_seq the process has acted on */
+    time_t since;               /* When lib and test_mode were chosen */
+    unsigned int stats_seq;     /* immsd: bumped to ask for the statistics of the allocator, never 0 */
+    unsigned int stats_ack;     /* The stats_seq the process has answered */
+    bool stats_native;          /* stats are reported by the allocators loaded, set again by a swap */
+    imms_malloc_stats_t stats;
+    unsigned int sample_rate;   /* immsd */
+    double sample_cost;         /* Nanoseconds spent on instrumenting a timed call */
+    char slow_lock;
+    unsigned long slow_min;     /* A call must be slower than this to get into slow */
+    imms_perf_slow_call_t slow[IMMS_PERF_SLOW_CALLS];
+    unsigned int threads_live;  /* The main thread and the threads started through pthread_create which haven't ended */
+    unsigned int threads_peak;
+    unsigned int threads_created;
+    unsigned int placement_next;
+    uint64_t placements[IMMS_PERF_PLACEMENTS];  /* Ring of timed allocations: the node of the allocating CPU + 1 in the page offset of the block */
+    unsigned int slot_next;
+    imms_perf_slot_t slots[IMMS_PERF_SLOTS];
+} imms_perf_shared_t;
 
 extern bool imms_perf_test_mode;
+extern unsigned char imms_perf_clock_source;
+extern imms_perf_shared_t *imms_perf_shared;
+extern __thread unsigned int imms_perf_sample_countdown __attribute__((tls_model("initial-exec")));
+
+void imms_perf_init(bool test_mode);
+void imms_perf_set_test_mode(bool test_mode);
+void imms_perf_set_lib(imms_library_t lib, bool test_mode);
+int imms_perf_thread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void*), void *arg);
+void imms_perf_publish_stats(unsigned int seq);
+void imms_perf_process(imms_perf_tick_t, imms_perf_tick_t, unsigned char, size_t[], const void*);
+bool imms_read_perf_result(int fd, imms_perf_result_t *perfres);
+bool imms_write_perf_result(int fd, const imms_perf_result_t *perfres);
+int imms_find_perf_summary(imms_perf_result_t *perfres, const char *name, bool add);
+bool imms_perf_res_open(bool writable);
+bool imms_perf_res_lookup(const char *path, imms_perf_res_entry_t *entry);
+bool imms_perf_res_entry(unsigned int slot, imms_perf_res_entry_t *entry);
+bool imms_perf_res_update(const char *path, unsigned int file, const imms_perf_result_t *perfres);
+void imms_perf_res_prune();
+
+/* Log-bucketed latency: the power of two and the next IMMS_PERF_HIST_SUB_BITS bits select the bucket */
+static inline unsigned int imms_perf_hist_bucket(unsigned long nsec)
+{
+    unsigned int msb, bucket;
+
+    if (nsec < (1 << IMMS_PERF_HIST_SUB_BITS))
+        return nsec;
+    msb = 63 - __builtin_clzl(nsec);
+    bucket = ((msb - IMMS_PERF_HIST_SUB_BITS + 1) << IMMS_PERF_HIST_SUB_BITS) +
+             ((nsec >> (msb - IMMS_PERF_HIST_SUB_BITS)) & ((1 << IMMS_PERF_HIST_SUB_BITS) - 1));
+
+    return bucket < IMMS_PERF_HIST_BUCKETS ? bucket : IMMS_PERF_HIST_BUCKETS - 1;
+}
+
+/* Lowest latency in nanoseconds that falls into the bucket */
+static inline unsigned long imms_perf_hist_nsec(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < (1 << IMMS_PERF_HIST_SUB_BITS))
+        return bucket;
+    shift = (bucket >> IMMS_PERF_HIST_SUB_BITS) - 1;
+
+    return ((1UL << IMMS_PERF_HIST_SUB_BITS) + (bucket & ((1 << IMMS_PERF_HIST_SUB_BITS) - 1))) << shift;
+}
+
+/* Class 0 holds sizes up to 16 bytes, class n up to 16 << n bytes */
+static inline unsigned int imms_perf_size_class(size_t size)
+{
+    unsigned int sc;
+
+    if (size <= 16)
+        return 0;
+    sc = 64 - __builtin_clzl(size - 1) - 4;
+
+    return sc < IMMS_PERF_SIZE_CLASSES ? sc : IMMS_PERF_SIZE_CLASSES - 1;
+}
+
+/* Every thread times 1 in sample_rate calls, immsd adapts the rate to the cost of timing */
+static inline bool imms_perf_sample()
+{
+    if (__builtin_expect(imms_perf_sample_countdown > 1, 1)) {
+        imms_perf_sample_countdown--;
+        return false;
+    }
+    imms_perf_sample_countdown = __atomic_load_n(&imms_perf_shared->sample_rate, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+static inline imms_perf_tick_t imms_perf_clock()
+{
+    struct timespec ts;
+
+#if defined(IMMS_PERF_TSC) && (defined(__x86_64__) || defined(__i386__))
+    if (IMMS_PERF_CLOCK_TSC == imms_perf_clock_source) {
+        unsigned int aux;
+
+        /* rdtscp waits for the preceding instructions, so the timed call can't leak out */
+        return __builtin_ia32_rdtscp(&aux);
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
 
-void imms_perf_init();
-void imms_perf_process(struct timespec*, struct timespec*, unsigned char, size_t[]);
\ No newline at end of file
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
\ No newline at end of file
@@ -0,0 +1,228 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "perf.h"
+
+#define INDEX_READ_TRIES    4       /* immsd may have died while writing an entry, until it restarts */
+
+static imms_perf_res_index_t *perf_res_index;
+
+static uint64_t perf_res_hash(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*path)
+        hash = (hash ^ (unsigned char)*path++) * 1099511628211ULL;
+
+    /* Zero marks an empty slot and IMMS_PERF_RES_INDEX_TOMBSTONE a removed entry */
+    return hash > IMMS_PERF_RES_INDEX_TOMBSTONE ? hash : IMMS_PERF_RES_INDEX_TOMBSTONE + 1;
+}
+
+/* Processes map the index read-only once it exists; immsd creates it */
+bool imms_perf_res_open(bool writable)
+{
+    imms_perf_res_index_t *index, *expected = NULL;
+    bool recreated = false;
+    struct stat st;
+    int fd;
+
+    if (__atomic_load_n(&perf_res_index, __ATOMIC_ACQUIRE))
+        return true;
+reopen:
+    fd = writable ? open(IMMS_PERF_RES_INDEX, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : open(IMMS_PERF_RES_INDEX, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd)
+        return false;
+    /* The file is sparse, only the touched slots take space */
+    if (fstat(fd, &st) == -1 || (st.st_size < sizeof(*index) && (!writable || ftruncate(fd, sizeof(*index)) == -1))) {
+        close(fd);
+        return false;
+    }
+    index = mmap(NULL, sizeof(*index), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED)
+        return false;
+    if (writable && !index->magic) {
+        index->version = IMMS_PERF_RES_INDEX_VERSION;
+        index->nslots = IMMS_PERF_RES_INDEX_SLOTS;
+        __atomic_store_n(&index->magic, IMMS_PERF_RES_INDEX_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (__atomic_load_n(&index->magic, __ATOMIC_ACQUIRE) != IMMS_PERF_RES_INDEX_MAGIC ||
+        index->version != IMMS_PERF_RES_INDEX_VERSION || index->nslots != IMMS_PERF_RES_INDEX_SLOTS) {
+        munmap(index, sizeof(*index));
+        /* immsd replaces an index of another layout, which it rebuilds from the records; processes mapping it keep the old file */
+        if (writable && !recreated && !unlink(IMMS_PERF_RES_INDEX)) {
+            recreated = true;
+            goto reopen;
+        }
+        imms_log_error("imms_perf_res_open index mismatch!");
+        return false;
+    }
+    if (!__atomic_compare_exchange_n(&perf_res_index, &expected, index, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        munmap(index, sizeof(*index));
+
+    return true;
+}
+
+/* Copies an entry out of the index under its seqlock, false if immsd seems to have died writing it */
+static bool perf_res_read(const imms_perf_res_entry_t *e, imms_perf_res_entry_t *entry)
+{
+    unsigned int seq, tries;
+
+    for (tries = 0; tries < INDEX_READ_TRIES; tries++) {
+        if ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(entry, e, sizeof(*entry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+            return true;
+    }
+
+    return false;
+}
+
+/* Copies the entry of path out of the index, false if there is none */
+bool imms_perf_res_lookup(const char *path, imms_perf_res_entry_t *entry)
+{
+    imms_perf_res_index_t *index;
+    uint64_t hash = perf_res_hash(path), h;
+    unsigned int i, n;
+
+    if (!imms_perf_res_open(false))
+        return false;
+    index = perf_res_index;
+    for (i = hash & (IMMS_PERF_RES_INDEX_SLOTS - 1), n = 0; n < IMMS_PERF_RES_INDEX_SLOTS; i = (i + 1) & (IMMS_PERF_RES_INDEX_SLOTS - 1), n++) {
+        if (!(h = __atomic_load_n(&index->hash[i], __ATOMIC_ACQUIRE)))
+            return false;
+        if (h == hash && perf_res_read(&index->entry[i], entry) && !strncmp(entry->path, path, PATH_MAX))
+            return true;
+    }
+
+    return false;
+}
+
+/* Copies the entry in slot out of the index, false if the slot holds none; for walking all the entries */
+bool imms_perf_res_entry(unsigned int slot, imms_perf_res_entry_t *entry)
+{
+    imms_perf_res_index_t *index = perf_res_index;
+
+    if (!index || slot >= IMMS_PERF_RES_INDEX_SLOTS ||
+        __atomic_load_n(&index->hash[slot], __ATOMIC_ACQUIRE) <= IMMS_PERF_RES_INDEX_TOMBSTONE)
+        return false;
+
+    return perf_res_read(&index->entry[slot], entry) && *entry->path;
+}
+
+/* Publishes the choice of perfres for path; only immsd writes, and a single thread of it per path */
+bool imms_perf_res_update(const char *path, unsigned int file, const imms_perf_result_t *perfres)
+{
+    imms_perf_res_index_t *index = perf_res_index;
+    imms_perf_res_entry_t *e;
+    uint64_t hash = perf_res_hash(path), h;
+    unsigned int i, n, seq, tomb;
+
+    if (!index)
+        return false;
+retry:
+    tomb = IMMS_PERF_RES_INDEX_SLOTS;
+    for (i = hash & (IMMS_PERF_RES_INDEX_SLOTS - 1), n = 0; n < IMMS_PERF_RES_INDEX_SLOTS; i = (i + 1) & (IMMS_PERF_RES_INDEX_SLOTS - 1), n++) {
+        h = __atomic_load_n(&index->hash[i], __ATOMIC_ACQUIRE);
+        if (h == hash && !strncmp(index->entry[i].path, path, PATH_MAX))
+            break;
+        if (IMMS_PERF_RES_INDEX_TOMBSTONE == h && tomb == IMMS_PERF_RES_INDEX_SLOTS)
+            tomb = i;
+        if (h)
+            continue;
+        /* The path has no entry; the first removed one on the way is reused before an empty slot */
+        if (tomb != IMMS_PERF_RES_INDEX_SLOTS) {
+            h = IMMS_PERF_RES_INDEX_TOMBSTONE;
+            /* Another thread of immsd taking it for another path starts the probing again */
+            if (!__atomic_compare_exchange_n(&index->hash[tomb], &h, hash, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                goto retry;
+            i = tomb;
+            break;
+        }
+        /* Other threads of immsd may take slots for other paths at the same time */
+        if (__atomic_compare_exchange_n(&index->hash[i], &h, hash, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (n == IMMS_PERF_RES_INDEX_SLOTS) {
+        h = IMMS_PERF_RES_INDEX_TOMBSTONE;
+        if (tomb == IMMS_PERF_RES_INDEX_SLOTS) {
+            imms_log_error("imms_perf_res_update index is full!");
+            return false;
+        }
+        if (!__atomic_compare_exchange_n(&index->hash[tomb], &h, hash, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            goto retry;
+        i = tomb;
+    }
+    e = &index->entry[i];
+    /* An odd seq left by an immsd which died while writing is skipped over */
+    seq = (e->seq + 1) | 1;
+    __atomic_store_n(&e->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->file = file;
+    e->test_mode = perfres->test_mode;
+    for (i = 0; i < 3; i++) {
+        strncpy(e->lib[i], perfres->result[i] < perfres->nlibs ? perfres->smr[perfres->result[i]].name : "", IMMS_MALLOC_LIB_NAME_MAX);
+        e->avgmem[i] = perfres->result[i] < perfres->nlibs ? perfres->smr[perfres->result[i]].avgmem : 0;
+        e->peakmem[i] = perfres->result[i] < perfres->nlibs ? perfres->smr[perfres->result[i]].peakmem : 0;
+    }
+    strncpy(e->lib[3], perfres->nextlib < perfres->nlibs ? perfres->smr[perfres->nextlib].name : "", IMMS_MALLOC_LIB_NAME_MAX);
+    e->nvar = perfres->result[2] < perfres->nlibs ? perfres->smr[perfres->result[2]].nvar : 0;
+    e->fingerprinted = perfres->fingerprinted;
+    memcpy(e->fingerprint, perfres->fingerprint, sizeof(e->fingerprint));
+    strncpy(e->path, path, PATH_MAX);
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*
+ * Entries whose record was removed become tombstones, which the probing goes on past and imms_perf_res_update reuses.
+ * So do entries left with an odd seq by an immsd which died while writing them, the rebuild writes them again.
+ */
+void imms_perf_res_prune()
+{
+    imms_perf_res_index_t *index = perf_res_index;
+    imms_perf_res_entry_t *e;
+    char path[PATH_MAX + 1], *name;
+    unsigned int i, seq;
+
+    if (!index)
+        return;
+    for (i = 0; i < IMMS_PERF_RES_INDEX_SLOTS; i++) {
+        e = &index->entry[i];
+        if (index->hash[i] <= IMMS_PERF_RES_INDEX_TOMBSTONE)
+            continue;
+        if (*e->path && !(e->seq & 1)) {
+            name = (name = strrchr(e->path, '/')) ? name + 1 : e->path;
+            snprintf(path, sizeof(path), "%s%s-%u", IMMS_PERF_RES_PATH, name, e->file);
+            if (!access(path, F_OK))
+                continue;
+        }
+        seq = (e->seq + 1) | 1;
+        __atomic_store_n(&e->seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        *e->path = 0;
+        __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&index->hash[i], IMMS_PERF_RES_INDEX_TOMBSTONE, __ATOMIC_RELEASE);
+    }
+}
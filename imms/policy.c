@@ -0,0 +1,360 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "imms.h"
+
+#define POLICY_NODES_MAX    65536
+
+static const imms_policy_t *policy;
+
+/* Wildcard match without allocating, since the policy is looked up while the allocator is loaded */
+static bool policy_match(const char *glob, const char *path)
+{
+    const char *star = NULL, *retry = NULL;
+
+    while (*path) {
+        if (*glob == '*') {
+            star = ++glob;
+            retry = path;
+        } else if (*glob == '?' || *glob == *path) {
+            glob++;
+            path++;
+        } else if (star) {
+            glob = star;
+            path = ++retry;
+        } else {
+            return false;
+        }
+    }
+    while (*glob == '*')
+        glob++;
+
+    return !*glob;
+}
+
+static const imms_policy_t* policy_map()
+{
+    const imms_policy_t *p;
+    struct stat st;
+    int fd;
+
+    fd = open(IMMS_POLICY_COMPILED, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd)
+        return NULL;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(*p)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (p->magic != IMMS_POLICY_MAGIC || p->version != IMMS_POLICY_VERSION ||
+        st.st_size != sizeof(*p) + (size_t)p->nnodes * sizeof(imms_policy_node_t) + (size_t)p->nrules * sizeof(imms_policy_rule_t) + p->strings) {
+        imms_log_error("imms_policy_lookup compiled policy mismatch!");
+        munmap((void*)p, st.st_size);
+        return NULL;
+    }
+
+    return p;
+}
+
+bool imms_policy_available()
+{
+    const imms_policy_t *p, *expected = NULL;
+
+    if (__atomic_load_n(&policy, __ATOMIC_ACQUIRE))
+        return true;
+    if (!(p = policy_map()))
+        return false;
+    if (!__atomic_compare_exchange_n(&policy, &expected, p, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        munmap((void*)p, sizeof(*p) + (size_t)p->nnodes * sizeof(imms_policy_node_t) + (size_t)p->nrules * sizeof(imms_policy_rule_t) + p->strings);
+
+    return true;
+}
+
+/* Returns the first rule matching path, NULL if there is none or immsd hasn't compiled the policy */
+const imms_policy_rule_t* imms_policy_lookup(const char *path)
+{
+    const imms_policy_t *pol;
+    const imms_policy_node_t *nodes;
+    const imms_policy_rule_t *rules, *rule = NULL;
+    const char *strings, *p = path;
+    unsigned int node, r;
+
+    if (!imms_policy_available())
+        return NULL;
+    pol = __atomic_load_n(&policy, __ATOMIC_ACQUIRE);
+    nodes = (const imms_policy_node_t*)(pol + 1);
+    rules = (const imms_policy_rule_t*)(nodes + pol->nnodes);
+    strings = (const char*)(rules + pol->nrules);
+    /* Node 0 is the root with the empty prefix; rules are stored in file order, so the lowest index wins */
+    for (node = 0;;) {
+        for (r = nodes[node].rules; r; r = rules[r - 1].next) {
+            if ((!rule || &rules[r - 1] < rule) && rules[r - 1].glob < pol->strings && policy_match(strings + rules[r - 1].glob, p))
+                rule = &rules[r - 1];
+        }
+        if (!*p)
+            break;
+        for (node = nodes[node].child; node && nodes[node - 1].c != *p; node = nodes[node - 1].sibling);
+        if (!node--)
+            break;
+        p++;
+    }
+
+    return rule;
+}
+
+typedef struct {
+    imms_policy_node_t *nodes;
+    imms_policy_rule_t *rules;
+    char *strings;
+    unsigned int nnodes, nrules, nstrings;
+    size_t rules_size, strings_size;
+} policy_builder_t;
+
+static const char *policy_metric_names[IMMS_POLICY_METRICS] = {
+    "time",
+    "p99",
+    "memfrag",
+    "rss",
+    "peak",
+    "contention",
+    "remote"
+};
+
+/* Parses <metric>:<value>[,<metric>:<value>]... into values indexed by IMMS_POLICY_METRIC_*; sizes may end in K, M or G */
+static void policy_parse_metrics(char *word, double values[])
+{
+    char *value, *end;
+    unsigned int i;
+    double v;
+
+    for (word = strtok_r(word, ",", &end); word; word = strtok_r(NULL, ",", &end)) {
+        if ((value = strchr(word, ':')))
+            *value++ = 0;
+        for (i = 0; i < IMMS_POLICY_METRICS && strcmp(word, policy_metric_names[i]); i++);
+        if (i == IMMS_POLICY_METRICS || !value) {
+            imms_log_error("imms_policy_compile unknown metric:");
+            imms_log_error(word);
+            continue;
+        }
+        v = strtod(value, &value);
+        if (*value == 'K' || *value == 'k')
+            v *= 1024;
+        else if (*value == 'M')
+            v *= 1024 * 1024;
+        else if (*value == 'G')
+            v *= 1024 * 1024 * 1024;
+        values[i] = v;
+    }
+}
+
+/* The rule being built is the one past the last, it is added by policy_add_pattern */
+static imms_policy_rule_t* policy_new_rule(policy_builder_t *b)
+{
+    imms_policy_rule_t *rule;
+    void *p;
+
+    if (b->nrules * sizeof(*rule) == b->rules_size) {
+        if (!(p = realloc(b->rules, (b->rules_size = b->rules_size * 2 + sizeof(*rule) * 16))))
+            return NULL;
+        b->rules = p;
+    }
+    rule = &b->rules[b->nrules];
+    memset(rule, 0, sizeof(*rule));
+
+    return rule;
+}
+
+/* The first prefix characters of pattern are literal and go into the trie, the rest is matched as a pattern */
+static bool policy_add_pattern(policy_builder_t *b, const char *pattern, size_t prefix)
+{
+    unsigned int node, child, i;
+    size_t len;
+    void *p;
+
+    for (node = 0, i = 0; i < prefix; i++, node = child - 1) {
+        for (child = b->nodes[node].child; child && b->nodes[child - 1].c != pattern[i]; child = b->nodes[child - 1].sibling);
+        if (!child) {
+            if (b->nnodes == POLICY_NODES_MAX)
+                return false;
+            memset(&b->nodes[b->nnodes], 0, sizeof(b->nodes[0]));
+            b->nodes[b->nnodes].c = pattern[i];
+            b->nodes[b->nnodes].sibling = b->nodes[node].child;
+            b->nodes[node].child = child = ++b->nnodes;
+        }
+    }
+    len = strlen(pattern + prefix) + 1;
+    if (b->nstrings + len > b->strings_size) {
+        if (!(p = realloc(b->strings, (b->strings_size = b->strings_size * 2 + len + 1024))))
+            return false;
+        b->strings = p;
+    }
+    memcpy(b->strings + b->nstrings, pattern + prefix, len);
+    b->rules[b->nrules].glob = b->nstrings;
+    b->nstrings += len;
+    /* Rules are chained in file order */
+    for (i = b->nodes[node].rules; i && b->rules[i - 1].next; i = b->rules[i - 1].next);
+    if (i)
+        b->rules[i - 1].next = b->nrules + 1;
+    else
+        b->nodes[node].rules = b->nrules + 1;
+    b->nrules++;
+
+    return true;
+}
+
+static bool policy_add_rule(policy_builder_t *b, char *line)
+{
+    imms_policy_rule_t *rule;
+    char *pattern, *word, *save, *end;
+    long value;
+
+    if (!(pattern = strtok_r(line, " \t", &save)) || *pattern == '#')
+        return true;
+    if (!(rule = policy_new_rule(b)))
+        return false;
+    while ((word = strtok_r(NULL, " \t", &save))) {
+        if (!strcmp(word, "exclude")) {
+            rule->flags |= IMMS_POLICY_EXCLUDE;
+        } else if (!strcmp(word, "explore=no")) {
+            rule->flags |= IMMS_POLICY_NO_EXPLORE;
+        } else if (!strcmp(word, "swap=yes")) {
+            rule->flags |= IMMS_POLICY_HOT_SWAP;
+        } else if (!strncmp(word, "pin=", 4)) {
+            strncpy(rule->pin, word + 4, IMMS_MALLOC_LIB_NAME_MAX - 1);
+        } else if (!strncmp(word, "mallopt=", 8) && rule->ntunables < IMMS_POLICY_TUNABLES_MAX && (end = strchr(word += 8, ':'))) {
+            *end++ = 0;
+            rule->tunables[rule->ntunables].param = imms_mallopt_param(word);
+            value = strtol(end, NULL, 0);
+            rule->tunables[rule->ntunables++].value = value;
+        } else if (!strncmp(word, "key=argv:", 9)) {
+            for (word += 9; *word; word += *word == ',') {
+                if ((value = strtol(word, &end, 10)) < 0 || value >= IMMS_POLICY_KEY_ARGV_MAX || end == word) {
+                    imms_log_error("imms_policy_compile bad argv index:");
+                    imms_log_error(word);
+                    break;
+                }
+                rule->key_argv |= 1u << value;
+                word = end;
+            }
+        } else if (!strncmp(word, "objective=", 10)) {
+            policy_parse_metrics(word + 10, rule->objective);
+        } else if (!strncmp(word, "limit=", 6)) {
+            policy_parse_metrics(word + 6, rule->limit);
+        } else if (!strcmp(word, "key=cgroup")) {
+            rule->flags |= IMMS_POLICY_KEY_CGROUP;
+        } else if (!strncmp(word, "key=env:", 8)) {
+            strncpy(rule->key_env, word + 8, IMMS_POLICY_KEY_ENV_MAX - 1);
+        } else {
+            imms_log_error("imms_policy_compile unknown rule:");
+            imms_log_error(word);
+        }
+    }
+
+    return policy_add_pattern(b, pattern, strcspn(pattern, "*?"));
+}
+
+/* A line of excluded-bins is a whole path, blanks and '?' included; a '*' makes what is before it a prefix */
+static bool policy_add_excluded(policy_builder_t *b, const char *line)
+{
+    char pattern[PATH_MAX + 2];
+    imms_policy_rule_t *rule;
+    size_t prefix;
+
+    if (!*line)
+        return true;
+    if (!(rule = policy_new_rule(b)))
+        return false;
+    rule->flags = IMMS_POLICY_EXCLUDE;
+    prefix = strcspn(line, "*");
+    if (prefix > PATH_MAX)
+        prefix = PATH_MAX;
+    memcpy(pattern, line, prefix);
+    strcpy(pattern + prefix, line[prefix] == '*' ? "*" : "");
+
+    return policy_add_pattern(b, pattern, prefix);
+}
+
+static bool policy_add_file(policy_builder_t *b, const char *path, bool exclude)
+{
+    char line[PATH_MAX + 1024], *eol;
+    bool ok = true;
+    FILE *f;
+
+    if (!(f = fopen(path, "r")))
+        return true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        if ((eol = strpbrk(line, "\r\n")))
+            *eol = 0;
+        ok = exclude ? policy_add_excluded(b, line) : policy_add_rule(b, line);
+    }
+    fclose(f);
+
+    return ok;
+}
+
+/* Compiles excluded-bins and the policy file for the processes; the new policy is renamed over the old one */
+bool imms_policy_compile()
+{
+    policy_builder_t b = {0};
+    const imms_policy_t *p;
+    imms_policy_t header;
+    char tmppath[PATH_MAX + 1];
+    bool ok = false;
+    int fd = -1;
+
+    if (!(b.nodes = calloc(POLICY_NODES_MAX, sizeof(b.nodes[0]))))
+        return false;
+    b.nnodes = 1;
+    if (!policy_add_file(&b, IMMS_POLICY_EXCLUDED_FILE, true) || !policy_add_file(&b, IMMS_POLICY_FILE, false)) {
+        imms_log_error("imms_policy_compile policy is too large!");
+        goto ret;
+    }
+    header.magic = IMMS_POLICY_MAGIC;
+    header.version = IMMS_POLICY_VERSION;
+    header.nnodes = b.nnodes;
+    header.nrules = b.nrules;
+    header.strings = b.nstrings;
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", IMMS_POLICY_COMPILED);
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (-1 == fd ||
+        write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, b.nodes, b.nnodes * sizeof(b.nodes[0])) != b.nnodes * sizeof(b.nodes[0]) ||
+        write(fd, b.rules, b.nrules * sizeof(b.rules[0])) != b.nrules * sizeof(b.rules[0]) ||
+        write(fd, b.strings, b.nstrings) != b.nstrings ||
+        rename(tmppath, IMMS_POLICY_COMPILED)) {
+        imms_log_error("imms_policy_compile write error!");
+        unlink(tmppath);
+        goto ret;
+    }
+    ok = true;
+    /* immsd looks rules up itself; the old mapping is left to lookups still walking it, the policy changes rarely */
+    if ((p = policy_map()))
+        __atomic_store_n(&policy, p, __ATOMIC_RELEASE);
+
+ret:
+    if (fd != -1)
+        close(fd);
+    free(b.nodes);
+    free(b.rules);
+    free(b.strings);
+    return ok;
+}
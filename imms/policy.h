@@ -0,0 +1,122 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define IMMS_POLICY_FILE            IMMS_PATH "policy"
+#define IMMS_POLICY_EXCLUDED_FILE   IMMS_PATH "excluded-bins"
+#define IMMS_POLICY_COMPILED        IMMS_PATH "policy.bin"
+#define IMMS_POLICY_MAGIC           0x504d4d49      /* "IMMP" */
+#define IMMS_POLICY_VERSION         5
+#define IMMS_POLICY_TUNABLES_MAX    8
+#define IMMS_POLICY_KEY_ARGV_MAX    32      /* Arguments from argv[0] which can be keyed on */
+#define IMMS_POLICY_KEY_ENV_MAX     64
+
+#define IMMS_POLICY_EXCLUDE         0x1     /* The system allocator without perf or swaps */
+#define IMMS_POLICY_NO_EXPLORE      0x2     /* Only the results of the record are used, nothing is tested */
+#define IMMS_POLICY_KEY_CGROUP      0x4     /* The cgroup of the process is a part of its key */
+#define IMMS_POLICY_HOT_SWAP        0x8     /* A process which isn't tested may still be swapped to a new choice */
+
+/* Metrics of an allocator which an objective weighs and limits bound */
+#define IMMS_POLICY_METRIC_TIME     0       /* Mean time of a call in seconds, weighted by the calls of each operation */
+#define IMMS_POLICY_METRIC_P99      1       /* 99th percentile latency in seconds */
+#define IMMS_POLICY_METRIC_MEMFRAG  2       /* Share of the resident memory not allocated */
+#define IMMS_POLICY_METRIC_RSS      3       /* Mean resident anonymous memory in bytes */
+#define IMMS_POLICY_METRIC_PEAK     4       /* Peak resident anonymous memory in bytes */
+#define IMMS_POLICY_METRIC_CONTENTION 5     /* Share of the calls which left the fast path, see IMMS_PERF_CONTENDED_NSEC */
+#define IMMS_POLICY_METRIC_REMOTE   6       /* Share of the allocations on another NUMA node than the CPU which made them */
+#define IMMS_POLICY_METRICS         7
+
+/*
+ * The policy file holds a rule per line, the first rule whose pattern matches the path of a
+ * binary applies to it:
+ *
+ *   <pattern> [exclude] [pin=<allocator>] [explore=no] [swap=yes] [mallopt=<param>:<value>]...
+ *             [key=argv:<index>[,<index>]...] [key=cgroup] [key=env:<name>]
+ *             [objective=<metric>:<weight>[,...]] [limit=<metric>:<max>[,...]]
+ *
+ * e.g.
+ *   /usr/sbin/cron*         exclude
+ *   /opt/db/bin/mysqld      pin=jemalloc
+ *   /usr/bin/python3*       explore=no mallopt=M_ARENA_MAX:2 key=argv:1
+ *   /usr/bin/java           key=env:SERVICE_NAME key=cgroup
+ *   /opt/api/bin/server     objective=time:1,p99:2 limit=peak:4G
+ *
+ * '*' matches any string, '/' included, and '?' any character. A pattern ends at the first
+ * blank, so a blank in a path is matched by '?'. param is a number or the name of a glibc M_*
+ * constant; the parameters are passed to the mallopt of the allocator in use.
+ *
+ * Only a process under test shares its counters with immsd, which is also how immsd tells it
+ * to swap its allocator. swap=yes gives the other processes of the rule the shared file too,
+ * so that a long running one moves to the allocator immsd chooses once the tests are over.
+ *
+ * Each line of excluded-bins is an exclude rule which comes before the policy file. Its
+ * matching is the same as before there was a policy: the line is the whole path, blanks
+ * and '?' included, and a '*' makes what is before it a prefix, ignoring what follows it.
+ *
+ * A binary has a single perf-res record unless its rule has keys: the arguments at the given
+ * indexes of argv, the cgroup and the value of the environment variable are hashed into the
+ * key of the record, the path followed by '#' and the hash, so every workload is tuned on
+ * its own.
+ *
+ * By default immsd keeps the fastest, the most memory efficient and a balanced allocator and
+ * the process picks one of them by the load of the system. An objective replaces them with
+ * the allocator of the lowest weighted sum of the metrics time, p99, memfrag, rss, peak,
+ * contention and remote, each relative to its mean over the allocators, among the allocators
+ * within the limits. If none is within them, the one exceeding them least is chosen.
+ *
+ * immsd compiles the rules into IMMS_POLICY_COMPILED, which processes map: a trie of the
+ * literal prefixes of the patterns, whose nodes chain the rules with that prefix, and the
+ * rest of each pattern in a string table.
+ */
+typedef struct {
+    int param;
+    int value;
+} imms_policy_tunable_t;
+
+typedef struct {
+    unsigned int next;          /* Next rule with the same prefix + 1, 0 at the end */
+    unsigned int glob;          /* Offset of the pattern after the prefix in the string table */
+    unsigned int flags;         /* IMMS_POLICY_* */
+    char pin[IMMS_MALLOC_LIB_NAME_MAX];     /* Empty if the allocator isn't pinned */
+    unsigned int ntunables;
+    imms_policy_tunable_t tunables[IMMS_POLICY_TUNABLES_MAX];
+    unsigned int key_argv;      /* Bit mask of the indexes of argv in the key */
+    char key_env[IMMS_POLICY_KEY_ENV_MAX];  /* Empty if no environment variable is in the key */
+    double objective[IMMS_POLICY_METRICS];  /* Weights of the metrics, all zero without an objective */
+    double limit[IMMS_POLICY_METRICS];      /* Zero if the metric has no limit */
+} imms_policy_rule_t;
+
+typedef struct {
+    unsigned int child;         /* First child + 1, 0 for a leaf */
+    unsigned int sibling;       /* Next child of the parent + 1 */
+    unsigned int rules;         /* First rule whose prefix ends here + 1 */
+    char c;
+} imms_policy_node_t;
+
+/* The nodes, the rules in the order of the file and the string table follow the header */
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nnodes;
+    unsigned int nrules;
+    unsigned int strings;       /* Size of the string table */
+} imms_policy_t;
+
+bool imms_policy_available();
+const imms_policy_rule_t* imms_policy_lookup(const char *path);
+bool imms_policy_compile();
@@ -0,0 +1,422 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "imms.h"
+
+#define REGISTRY_FILE       IMMS_MALLOC_LIB_PATH "registry"
+#define REGISTRY_SIZE_MAX   8192
+#define REGISTRY_EXPLORE_MAX    3       /* Explored tunables of an entry */
+#define REGISTRY_EXPLORE_VALUES 8       /* Values of an explored tunable */
+
+/*
+ * The registry declares the allocators IMMS can load, one per line:
+ *
+ *   <name> <file in IMMS_MALLOC_LIB_PATH> [prefix=<p>] [<function>=<symbol>]... [require=<function>,...]
+ *
+ * e.g.
+ *   mimalloc    libmimalloc.so          prefix=mi_ free_sized=mi_free_size
+ *   snmalloc    libsnmallocshim.so      prefix=sn_
+ *   rpmalloc    librpmalloc.so          prefix=rp init=rpmalloc_initialize
+ *
+ * A function without a symbol is looked up as prefix + function name, except init which
+ * is called once after loading, and get_property and mallinfo2 which are only looked up
+ * when they are given. mallctl, get_property and mallinfo2 report the statistics of the
+ * allocator. "-" as a symbol leaves the function out. malloc, realloc,
+ * free, memalign, calloc and malloc_usable_size are always required. Lines starting with
+ * '#' are comments. The system allocator is always the first entry; without a registry
+ * file the built-in allocators below are used.
+ *
+ * set=<kind>:<name>:<value> sets a tunable whenever the allocator is loaded or swapped in:
+ *
+ *   mallopt:<param>:<value>     mallopt, param is a number or a glibc M_* name
+ *   mallctl:<name>:<value>      mallctl of jemalloc, for settings writable at run time
+ *   property:<name>:<value>     MallocExtension_SetNumericProperty of tcmalloc
+ *
+ * tune=<kind>:<name>:<value>[,<value>]... makes immsd search the settings of an allocator: the
+ * entry is replaced by a variant per combination of the values of its tune tunables, named
+ * <name>+<value>[+<value>]..., each measured and explored on its own like an allocator. The
+ * registry holds IMMS_MALLOC_LIB_MAX entries, variants included, which caps the search:
+ *
+ *   System-arenas   -                       prefix= tune=mallopt:M_ARENA_MAX:1,2,8
+ *   jemalloc        libjemalloc.so          prefix=je_ tune=mallctl:arenas.dirty_decay_ms:0,1000,10000
+ *
+ * The same file may also be declared several times by hand with different names and set
+ * tunables. A setting stays once it is applied, so a process hot-swaps between two entries
+ * of the same file only if they set the same tunables, as the variants do; otherwise it
+ * keeps its allocator and the other entry is tested by its next run.
+ *
+ * numa=arenas gives an allocator with mallctl an arena per NUMA node on a host with several
+ * nodes, and binds each thread to the arena of the node it starts on, so that an arena's
+ * pages are first touched on its node. Settings read at startup only, such as jemalloc's
+ * percpu_arena, can't be made this way.
+ */
+typedef struct {
+    imms_malloc_tunable_t tunable;
+    long values[REGISTRY_EXPLORE_VALUES];
+    unsigned int nvalues;
+} registry_explore_t;
+
+static const char *registry_sym_names[IMMS_MALLOC_SYM_END] = {
+    "malloc",
+    "realloc",
+    "free",
+    "memalign",
+    "calloc",
+    "malloc_usable_size",
+    "mallopt",
+    "free_sized",
+    "free_aligned_sized",
+    "sdallocx",
+    "pthread_create",
+    "pthread_exit",
+    "init",
+    "mallctl",
+    "set_property",
+    "get_property",
+    "mallinfo2"
+};
+
+static const struct {
+    const char *name;
+    int param;
+} registry_mallopt_params[] = {
+    { "M_MXFAST", 1 },
+    { "M_TRIM_THRESHOLD", -1 },
+    { "M_TOP_PAD", -2 },
+    { "M_MMAP_THRESHOLD", -3 },
+    { "M_MMAP_MAX", -4 },
+    { "M_CHECK_ACTION", -5 },
+    { "M_PERTURB", -6 },
+    { "M_ARENA_TEST", -7 },
+    { "M_ARENA_MAX", -8 }
+};
+
+static const char registry_system[] = "System - prefix= mallinfo2=mallinfo2\n";
+
+static const char registry_default[] =
+    "Hoard      libhoard.so             prefix=hoard_ require=mallopt,pthread_create,pthread_exit\n"
+    "TCMalloc   libtcmalloc_minimal.so  prefix=tc_ malloc_usable_size=tc_malloc_size set_property=MallocExtension_SetNumericProperty get_property=MallocExtension_GetNumericProperty require=mallopt\n"
+    "jemalloc   libjemalloc.so          prefix=je_ mallctl=je_mallctl\n";
+
+imms_malloc_lib_t imms_malloc_libs[IMMS_MALLOC_LIB_MAX];
+unsigned int imms_malloc_lib_count;
+
+static int registry_find_sym(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < IMMS_MALLOC_SYM_END; i++) {
+        if (strlen(registry_sym_names[i]) == len && !strncmp(registry_sym_names[i], name, len))
+            return i;
+    }
+
+    return -1;
+}
+
+/* The value of a glibc M_* name, or the number in name */
+int imms_mallopt_param(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(registry_mallopt_params) / sizeof(registry_mallopt_params[0]); i++) {
+        if (!strcmp(registry_mallopt_params[i].name, name))
+            return registry_mallopt_params[i].param;
+    }
+
+    return strtol(name, NULL, 0);
+}
+
+/* Parses <kind>:<name>:<values> into t, returns the values or NULL */
+static char* registry_parse_tunable(imms_malloc_tunable_t *t, char *value)
+{
+    char *name, *values;
+
+    memset(t, 0, sizeof(*t));
+    if (!(name = strchr(value, ':')) || !(values = strrchr(++name, ':'))) {
+        imms_log_error("registry_parse_line bad tunable!");
+        imms_log_error(value);
+        return NULL;
+    }
+    name[-1] = *values++ = 0;
+    if (!strcmp(value, "mallopt")) {
+        t->kind = IMMS_MALLOC_TUNE_MALLOPT;
+        t->param = imms_mallopt_param(name);
+    } else if (!strcmp(value, "mallctl")) {
+        t->kind = IMMS_MALLOC_TUNE_MALLCTL;
+    } else if (!strcmp(value, "property")) {
+        t->kind = IMMS_MALLOC_TUNE_PROPERTY;
+    } else {
+        imms_log_error("registry_parse_line unknown tunable!");
+        imms_log_error(value);
+        return NULL;
+    }
+    strncpy(t->name, name, sizeof(t->name) - 1);
+
+    return values;
+}
+
+/* Parses <kind>:<name>:<value>[,<value>]... into the next explored tunable */
+static void registry_parse_explore(registry_explore_t explore[], unsigned int *nexplore, char *value)
+{
+    registry_explore_t *e = &explore[*nexplore];
+    char *values, *end;
+
+    if (*nexplore == REGISTRY_EXPLORE_MAX) {
+        imms_log_error("registry_parse_line too many explored tunables!");
+        imms_log_error(value);
+        return;
+    }
+    if (!(values = registry_parse_tunable(&e->tunable, value)))
+        return;
+    for (e->nvalues = 0; *values && e->nvalues < REGISTRY_EXPLORE_VALUES; values = end + (*end == ',')) {
+        e->values[e->nvalues++] = strtol(values, &end, 0);
+        if (end == values || (*end && *end != ',')) {
+            imms_log_error("registry_parse_line bad tunable value!");
+            imms_log_error(values);
+            return;
+        }
+    }
+    if (e->nvalues)
+        (*nexplore)++;
+}
+
+/*****************************************************************************************
+ *  Replaces the entry being parsed with a variant per combination of the values of its
+ *  explored tunables, named <name>+<value>[+<value>]...; immsd explores them as it does
+ *  allocators. Every variant sets every explored tunable, so that a hot swap between two
+ *  of them leaves no setting of the other behind. Variants beyond IMMS_MALLOC_LIB_MAX
+ *  are left out.
+ *****************************************************************************************/
+static void registry_add_variants(const registry_explore_t explore[], unsigned int nexplore)
+{
+    static imms_malloc_lib_t base;
+    imms_malloc_lib_t *ml;
+    unsigned int v, i, k, count = 1;
+    size_t len;
+
+    memcpy(&base, &imms_malloc_libs[imms_malloc_lib_count], sizeof(base));
+    for (i = 0; i < nexplore; i++)
+        count *= explore[i].nvalues;
+    if (base.ntunables + nexplore > IMMS_MALLOC_TUNABLES_MAX) {
+        imms_log_error("registry_parse_line too many tunables!");
+        imms_log_error(base.name);
+        return;
+    }
+    for (v = 0; v < count; v++) {
+        if (imms_malloc_lib_count == IMMS_MALLOC_LIB_MAX) {
+            imms_log_error("registry_parse_line too many variants!");
+            imms_log_error(base.name);
+            return;
+        }
+        ml = &imms_malloc_libs[imms_malloc_lib_count];
+        memcpy(ml, &base, sizeof(*ml));
+        /* The values of the first tunable change the slowest */
+        for (i = nexplore, k = v; i--; k /= explore[i].nvalues) {
+            ml->tunables[ml->ntunables] = explore[i].tunable;
+            ml->tunables[ml->ntunables++].value = explore[i].values[k % explore[i].nvalues];
+        }
+        for (i = 0; i < nexplore; i++) {
+            len = strlen(ml->name);
+            snprintf(ml->name + len, sizeof(ml->name) - len, "+%ld", ml->tunables[base.ntunables + nexplore - 1 - i].value);
+        }
+        if (imms_find_malloc_lib(ml->name) != -1) {
+            imms_log_error("registry_parse_line variant name is not unique!");
+            imms_log_error(ml->name);
+            continue;
+        }
+        imms_malloc_lib_count++;
+    }
+}
+
+/* The functions for tunables are looked up only when the entry has tunables of their kind, those for statistics when they are given */
+static bool registry_wants_sym(const imms_malloc_lib_t *ml, const registry_explore_t explore[], unsigned int nexplore, int sym)
+{
+    unsigned char kind;
+    unsigned int i;
+
+    if (IMMS_MALLOC_SYM_INIT == sym || IMMS_MALLOC_SYM_GET_PROPERTY == sym || IMMS_MALLOC_SYM_MALLINFO2 == sym)
+        return false;
+    if (IMMS_MALLOC_SYM_MALLCTL == sym)
+        kind = IMMS_MALLOC_TUNE_MALLCTL;
+    else if (IMMS_MALLOC_SYM_SET_PROPERTY == sym)
+        kind = IMMS_MALLOC_TUNE_PROPERTY;
+    else
+        return true;
+    for (i = 0; i < ml->ntunables; i++) {
+        if (ml->tunables[i].kind == kind)
+            return true;
+    }
+    for (i = 0; i < nexplore; i++) {
+        if (explore[i].tunable.kind == kind)
+            return true;
+    }
+
+    return false;
+}
+
+/* Copies the token at sz to dst, returns the character after it */
+static const char* registry_token(const char *sz, const char *end, char *dst, size_t size)
+{
+    size_t i = 0;
+
+    for (; sz < end && *sz != ' ' && *sz != '\t' && *sz != '\n' && *sz != '\r'; sz++) {
+        if (i < size - 1)
+            dst[i++] = *sz;
+    }
+    dst[i] = 0;
+
+    return sz;
+}
+
+static const char* registry_skip_space(const char *sz, const char *end)
+{
+    while (sz < end && (*sz == ' ' || *sz == '\t' || *sz == '\r'))
+        sz++;
+
+    return sz;
+}
+
+/* Parses one line into the next free entry, returns the start of the next line */
+static const char* registry_parse_line(const char *sz, const char *end)
+{
+    imms_malloc_lib_t *ml = &imms_malloc_libs[imms_malloc_lib_count];
+    char token[IMMS_MALLOC_SYM_MAX * 2], prefix[IMMS_MALLOC_SYM_MAX] = {0}, *value;
+    registry_explore_t explore[REGISTRY_EXPLORE_MAX];
+    unsigned int explicit = 0, nexplore = 0;
+    bool has_prefix = false;
+    int i;
+
+    sz = registry_skip_space(sz, end);
+    if (sz == end || *sz == '\n' || *sz == '#' || imms_malloc_lib_count == IMMS_MALLOC_LIB_MAX)
+        goto next;
+    memset(ml, 0, sizeof(*ml));
+    sz = registry_token(sz, end, ml->name, sizeof(ml->name));
+    sz = registry_token(registry_skip_space(sz, end), end, ml->file, sizeof(ml->file));
+    /* The built-in system allocator can't be redeclared, nor can an earlier entry */
+    if (imms_find_malloc_lib(ml->name) != -1) {
+        imms_log_error("registry_parse_line allocator name is not unique!");
+        imms_log_error(ml->name);
+        goto next;
+    }
+    if (!*ml->file) {
+        imms_log_error("registry_parse_line allocator without file!");
+        imms_log_error(ml->name);
+        goto next;
+    }
+    ml->required = IMMS_MALLOC_SYM_REQUIRED;
+    for (;;) {
+        sz = registry_skip_space(sz, end);
+        if (sz == end || *sz == '\n')
+            break;
+        sz = registry_token(sz, end, token, sizeof(token));
+        if (!(value = strchr(token, '='))) {
+            imms_log_error("registry_parse_line missing '='!");
+            imms_log_error(token);
+            continue;
+        }
+        *value++ = 0;
+        if (!strcmp(token, "prefix")) {
+            strncpy(prefix, value, sizeof(prefix) - 1);
+            has_prefix = true;
+        } else if (!strcmp(token, "set")) {
+            if (ml->ntunables == IMMS_MALLOC_TUNABLES_MAX) {
+                imms_log_error("registry_parse_line too many tunables!");
+                imms_log_error(value);
+            } else if ((value = registry_parse_tunable(&ml->tunables[ml->ntunables], value))) {
+                ml->tunables[ml->ntunables++].value = strtol(value, NULL, 0);
+            }
+        } else if (!strcmp(token, "tune")) {
+            registry_parse_explore(explore, &nexplore, value);
+        } else if (!strcmp(token, "numa")) {
+            if (!strcmp(value, "arenas")) {
+                ml->flags |= IMMS_MALLOC_NUMA_ARENAS;
+            } else {
+                imms_log_error("registry_parse_line unknown numa mode!");
+                imms_log_error(value);
+            }
+        } else if (!strcmp(token, "require")) {
+            while (*value) {
+                size_t len = strcspn(value, ",");
+
+                if ((i = registry_find_sym(value, len)) != -1)
+                    ml->required |= 1 << i;
+                value += len + (value[len] ? 1 : 0);
+            }
+        } else if ((i = registry_find_sym(token, strlen(token))) != -1) {
+            if (strcmp(value, "-"))
+                strncpy(ml->sym[i], value, sizeof(ml->sym[i]) - 1);
+            explicit |= 1 << i;
+        } else {
+            imms_log_error("registry_parse_line unknown function!");
+            imms_log_error(token);
+        }
+    }
+    for (i = 0; has_prefix && i < IMMS_MALLOC_SYM_END; i++) {
+        if (!(explicit & (1 << i)) && registry_wants_sym(ml, explore, nexplore, i))
+            snprintf(ml->sym[i], sizeof(ml->sym[i]), "%s%s", prefix, registry_sym_names[i]);
+    }
+    if (nexplore)
+        registry_add_variants(explore, nexplore);
+    else
+        imms_malloc_lib_count++;
+
+next:
+    while (sz < end && *sz++ != '\n');
+    return sz;
+}
+
+static void registry_parse(const char *sz, const char *end)
+{
+    while (sz < end)
+        sz = registry_parse_line(sz, end);
+}
+
+/* Load the registry without allocating memory, since it is read while loading the allocator */
+void imms_load_malloc_registry()
+{
+    static char buf[REGISTRY_SIZE_MAX];
+    ssize_t size = 0, n;
+    int fd;
+
+    imms_malloc_lib_count = 0;
+    registry_parse(registry_system, registry_system + sizeof(registry_system) - 1);
+    fd = open(REGISTRY_FILE, O_RDONLY);
+    if (-1 == fd) {
+        registry_parse(registry_default, registry_default + sizeof(registry_default) - 1);
+        return;
+    }
+    while (size < sizeof(buf) && (n = read(fd, buf + size, sizeof(buf) - size)) > 0)
+        size += n;
+    close(fd);
+    if (size == sizeof(buf))
+        imms_log_error("imms_load_malloc_registry registry is truncated!");
+    registry_parse(buf, buf + size);
+}
+
+int imms_find_malloc_lib(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < imms_malloc_lib_count; i++) {
+        if (!strncmp(imms_malloc_libs[i].name, name, IMMS_MALLOC_LIB_NAME_MAX))
+            return i;
+    }
+
+    return -1;
+}
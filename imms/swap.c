@@ -0,0 +1,258 @@
+/* The Intelligent Memory Management System (IMMS)
+ * Copyright (C) 2015 Onur Ülgen
+ *
+ * This file is part of IMMS.
+ *
+ * IMMS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * IMMS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include "perf.h"
+
+/*
+ *  Allocator hot-swap. Once a process swaps its allocator, blocks of every loaded
+ *  allocator live side by side, so each block is marked with its owner in a page
+ *  map: a byte per page holds the owner + 1. Pages without a mark belong to the
+ *  allocator the process started with, so blocks allocated before the first swap
+ *  need no mark. Allocators don't share pages, hence the page of a block's address
+ *  tells its owner; a stale mark left by an allocator which gave the page back is
+ *  overwritten by the next block allocated on it. A mark covers a page of the host,
+ *  so the map is coarser with 16 or 64 KB pages; the root is sized for 4 KB ones.
+ *  Pages are only kept apart by mmap: two allocators growing the brk heap, such as
+ *  glibc's main arena and tcmalloc's SbrkSysAllocator, may meet within a page if one
+ *  of them leaves the break unaligned, which nothing here can detect.
+ */
+#define SWAP_PAGE_SHIFT_MIN 12
+#define SWAP_LEAF_BITS      20      /* A leaf maps 4 GB of address space with 1 MB at the smallest pages */
+#define SWAP_ROOT_BITS      (48 - SWAP_PAGE_SHIFT_MIN - SWAP_LEAF_BITS)
+
+__thread unsigned int imms_swap_poll_countdown __attribute__((tls_model("initial-exec")));
+static unsigned char *swap_map[1 << SWAP_ROOT_BITS];
+static imms_library_t swap_base;            /* Owner of the pages without a mark */
+static imms_library_t swap_current;         /* New blocks come from this allocator */
+static unsigned int swap_page_shift;        /* Set before the first block is marked */
+
+static unsigned char* swap_leaf(const void *ptr, bool create)
+{
+    uintptr_t root = (uintptr_t)ptr >> (swap_page_shift + SWAP_LEAF_BITS);
+    unsigned char *leaf, *expected = NULL;
+
+    if (root >= (1 << SWAP_ROOT_BITS))
+        return NULL;
+    leaf = __atomic_load_n(&swap_map[root], __ATOMIC_ACQUIRE);
+    if (leaf || !create)
+        return leaf;
+    leaf = mmap(NULL, 1 << SWAP_LEAF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (leaf == MAP_FAILED)
+        return NULL;
+    if (!__atomic_compare_exchange_n(&swap_map[root], &expected, leaf, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(leaf, 1 << SWAP_LEAF_BITS);
+        leaf = expected;
+    }
+
+    return leaf;
+}
+
+static inline size_t swap_page(const void *ptr)
+{
+    return ((uintptr_t)ptr >> swap_page_shift) & ((1 << SWAP_LEAF_BITS) - 1);
+}
+
+static inline imms_library_t swap_owner(const void *ptr)
+{
+    unsigned char *leaf = swap_leaf(ptr, false), mark;
+
+    if (!leaf || !(mark = __atomic_load_n(&leaf[swap_page(ptr)], __ATOMIC_RELAXED)))
+        return swap_base;
+
+    return mark - 1;
+}
+
+/* Mark the block with its owner; without memory for the map, it moves to the base allocator which needs no mark */
+static void* swap_record(void *p, imms_library_t lib, size_t alignment, size_t size)
+{
+    imms_malloc_funcs_t *base = &imms_malloc_funcs[swap_base];
+    unsigned char *leaf;
+    void *q;
+
+    if (!p)
+        return NULL;
+    if ((leaf = swap_leaf(p, true))) {
+        __atomic_store_n(&leaf[swap_page(p)], lib + 1, __ATOMIC_RELAXED);
+        return p;
+    }
+    if (lib == swap_base)
+        return p;
+    if ((q = alignment ? base->memalign(alignment, size) : base->malloc(size)))
+        memcpy(q, p, size);
+    imms_malloc_funcs[lib].free(p);
+
+    return swap_record(q, swap_base, 0, 0);
+}
+
+static void* swap_malloc(size_t size)
+{
+    imms_library_t lib = __atomic_load_n(&swap_current, __ATOMIC_ACQUIRE);
+
+    return swap_record(imms_malloc_funcs[lib].malloc(size), lib, 0, size);
+}
+
+static void* swap_calloc(size_t numelm, size_t elmsize)
+{
+    imms_library_t lib = __atomic_load_n(&swap_current, __ATOMIC_ACQUIRE);
+
+    /* The calloc hook has already checked the multiplication */
+    return swap_record(imms_malloc_funcs[lib].calloc(numelm, elmsize), lib, 0, numelm * elmsize);
+}
+
+static void* swap_memalign(size_t alignment, size_t size)
+{
+    imms_library_t lib = __atomic_load_n(&swap_current, __ATOMIC_ACQUIRE);
+
+    return swap_record(imms_malloc_funcs[lib].memalign(alignment, size), lib, alignment, size);
+}
+
+/* Blocks of a previous allocator move to the current one when they are resized */
+static void* swap_realloc(void *ptr, size_t size)
+{
+    imms_library_t lib = __atomic_load_n(&swap_current, __ATOMIC_ACQUIRE), owner;
+    size_t copy;
+    void *p;
+
+    if (!ptr)
+        return swap_malloc(size);
+    if ((owner = swap_owner(ptr)) == lib)
+        return swap_record(imms_malloc_funcs[lib].realloc(ptr, size), lib, 0, size);
+    if (!size) {
+        imms_malloc_funcs[owner].free(ptr);
+        return NULL;
+    }
+    if ((p = swap_malloc(size))) {
+        copy = imms_malloc_funcs[owner].malloc_usable_size(ptr);
+        memcpy(p, ptr, copy < size ? copy : size);
+        imms_malloc_funcs[owner].free(ptr);
+    }
+
+    return p;
+}
+
+static void swap_free(void *ptr)
+{
+    imms_malloc_funcs[swap_owner(ptr)].free(ptr);
+}
+
+static void swap_free_sized(void *ptr, size_t size)
+{
+    imms_malloc_funcs_t *mf = &imms_malloc_funcs[swap_owner(ptr)];
+
+    if (mf->free_sized)
+        mf->free_sized(ptr, size);
+    else
+        mf->free(ptr);
+}
+
+static void swap_free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    imms_malloc_funcs_t *mf = &imms_malloc_funcs[swap_owner(ptr)];
+
+    if (mf->free_aligned_sized)
+        mf->free_aligned_sized(ptr, alignment, size);
+    else
+        mf->free(ptr);
+}
+
+static size_t swap_malloc_usable_size(void *ptr)
+{
+    return imms_malloc_funcs[swap_owner(ptr)].malloc_usable_size(ptr);
+}
+
+static int swap_mallopt(int param, int value)
+{
+    imms_malloc_funcs_t *mf = &imms_malloc_funcs[__atomic_load_n(&swap_current, __ATOMIC_ACQUIRE)];
+
+    return mf->mallopt ? mf->mallopt(param, value) : 0;
+}
+
+/* New blocks come from lib; blocks of the previous allocators go back to them when they are freed */
+bool imms_swap_malloc_lib(imms_library_t lib)
+{
+    if (lib == imms_loaded_malloc_lib)
+        return true;
+    if (!imms_load_malloc_funcs(lib))
+        return false;
+    imms_apply_malloc_tunables(lib);
+    /* The dispatchers are in place before the first block of another allocator exists */
+    if (imms_malloc != swap_malloc) {
+        swap_page_shift = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+        if (swap_page_shift < SWAP_PAGE_SHIFT_MIN)
+            swap_page_shift = SWAP_PAGE_SHIFT_MIN;
+        swap_base = swap_current = imms_loaded_malloc_lib;
+        __atomic_store_n(&imms_free, swap_free, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_free_sized, swap_free_sized, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_free_aligned_sized, swap_free_aligned_sized, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_malloc_usable_size, swap_malloc_usable_size, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_mallopt, swap_mallopt, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_realloc, swap_realloc, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_memalign, swap_memalign, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_calloc, swap_calloc, __ATOMIC_RELEASE);
+        __atomic_store_n(&imms_malloc, swap_malloc, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&swap_current, lib, __ATOMIC_RELEASE);
+    imms_loaded_malloc_lib = lib;
+    /* Only the swapping thread and the threads started from now on move to the arenas of their nodes */
+    imms_numa_bind_thread();
+    IMMS_VERBOSE_MSGWPTR("imms_swap_malloc_lib swapped to", lib);
+
+    return true;
+}
+
+/*
+ * immsd bumps swap_seq when the perf-res record of the process changed and stats_seq when it
+ * wants the statistics of the allocator; the hooks call this every IMMS_SWAP_POLL_CALLS calls
+ */
+void imms_swap_check()
+{
+    static char lock;
+    imms_perf_shared_t *shared = imms_perf_shared;
+    char *procfilepath;
+    unsigned int seq, stats_seq;
+    bool test_mode;
+    int lib;
+
+    imms_swap_poll_countdown = IMMS_SWAP_POLL_CALLS;
+    if (!shared)
+        return;
+    seq = __atomic_load_n(&shared->swap_seq, __ATOMIC_ACQUIRE);
+    stats_seq = __atomic_load_n(&shared->stats_seq, __ATOMIC_ACQUIRE);
+    if (seq == shared->swap_ack && stats_seq == shared->stats_ack)
+        return;
+    /* Loading the allocator allocates, which must not check again */
+    if (__sync_lock_test_and_set(&lock, 1))
+        return;
+    if (seq != shared->swap_ack && (procfilepath = imms_process_filepath())) {
+        lib = imms_select_malloc_lib(procfilepath, &test_mode);
+        /* Settings of an entry loaded before can't be undone, so lib waits for the next run */
+        if (!imms_malloc_lib_swappable(lib)) {
+            test_mode = false;
+        } else if (!imms_swap_malloc_lib(lib)) {
+            imms_log_error("imms_swap_check imms_swap_malloc_lib error!");
+            test_mode = false;
+        }
+        imms_perf_set_lib(imms_loaded_malloc_lib, test_mode);
+    }
+    __atomic_store_n(&shared->swap_ack, seq, __ATOMIC_RELEASE);
+    if (stats_seq != shared->stats_ack)
+        imms_perf_publish_stats(stats_seq);
+    __sync_lock_release(&lock);
+}
@@ -22,13 +22,6 @@
 #define	LOG_ERROR_PATH		IMMS_PATH "error-logs/"
 #define	SPD					(24 * 60 * 60)
 
-const char *imms_malloc_lib_names[] = {
-    "System",
-    "Hoard",
-    "TCMalloc",
-    "jemalloc"
-};
-
 /* malloc-less time functions imported from diet libc <http://www.fefe.de/dietlibc/> */
 /* days per month -- nonleap! */
 static int imms_isleap(int year)
@@ -98,73 +91,312 @@ static struct tm* imms_localtime_r(const time_t *t, struct tm *r)
 	return imms_gmtime_r(&tmp, r);
 }
 
+/*
+ * One-time initialisation: returns true to the single caller that has to run it,
+ * which then calls imms_once_done, or imms_once_fail to let the next caller retry.
+ * Other callers sleep on a futex instead of polling until it is done.
+ */
+bool imms_once(int *once)
+{
+    int state = __atomic_load_n(once, __ATOMIC_ACQUIRE);
+
+    while (state != IMMS_ONCE_DONE) {
+        if (IMMS_ONCE_NONE == state) {
+            if (__atomic_compare_exchange_n(once, &state, IMMS_ONCE_RUNNING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+                return true;
+            continue;
+        }
+        if (IMMS_ONCE_RUNNING == state &&
+            !__atomic_compare_exchange_n(once, &state, IMMS_ONCE_WAITING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            continue;
+        syscall(SYS_futex, once, FUTEX_WAIT_PRIVATE, IMMS_ONCE_WAITING, NULL, NULL, 0);
+        state = __atomic_load_n(once, __ATOMIC_ACQUIRE);
+    }
+
+    return false;
+}
+
+static void imms_once_set(int *once, int state)
+{
+    if (__atomic_exchange_n(once, state, __ATOMIC_RELEASE) == IMMS_ONCE_WAITING)
+        syscall(SYS_futex, once, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void imms_once_done(int *once)
+{
+    imms_once_set(once, IMMS_ONCE_DONE);
+}
+
+void imms_once_fail(int *once)
+{
+    imms_once_set(once, IMMS_ONCE_NONE);
+}
+
 char* imms_process_filename()
 {
 	static char procfilename[NAME_MAX + 1] = {0};
-	static char initialised = 0;
+	static int once = IMMS_ONCE_NONE;
 
-    if (initialised != 3) {
-		if (!__sync_fetch_and_or(&initialised, 1)) {
-		    int fd, i;
-            char c;
+    if (imms_once(&once)) {
+        int fd, i;
+        char c;
 
-            fd = open("/proc/self/stat", O_RDONLY);
-            if (-1 == fd)
+        fd = open("/proc/self/stat", O_RDONLY);
+        if (-1 == fd)
+            goto errret;
+        do {
+            if (read(fd, &c, 1) != 1) {
+                close(fd);
                 goto errret;
-            do {
-                if (read(fd, &c, 1) != 1) {
-                    close(fd);
-                    goto errret;
-                }
-            } while (c != '(');
-            i = 0;
-            do {
-                if (read(fd, &c, 1) == 1) {
-                    procfilename[i++] = c;
-                } else {
-                    close(fd);
-                    goto errret;
-                }
-            } while ((c != ')') && (i != sizeof(procfilename)));
-            procfilename[i - 1] = 0;
-            close(fd);
-			__sync_fetch_and_or(&initialised, 2);
-		} else {
-			while (1 == initialised)
-				usleep(1000);
-		}
+            }
+        } while (c != '(');
+        i = 0;
+        do {
+            if (read(fd, &c, 1) == 1) {
+                procfilename[i++] = c;
+            } else {
+                close(fd);
+                goto errret;
+            }
+        } while ((c != ')') && (i != sizeof(procfilename)));
+        procfilename[i - 1] = 0;
+        close(fd);
+        imms_once_done(&once);
 	}
 
 	return *procfilename ? procfilename : NULL;
 
 errret:
     *procfilename = 0;
-    initialised = 0;
+    imms_once_fail(&once);
     return NULL;
 }
 
 char* imms_process_filepath()
 {
 	static char procfilepath[PATH_MAX + 1] = {0};
-	static char initialised = 0;
+	static int once = IMMS_ONCE_NONE;
 	ssize_t size;
 
-    if (initialised != 3) {
-		if (!__sync_fetch_and_or(&initialised, 1)) {
-            if ((size = readlink("/proc/self/exe", procfilepath, sizeof(procfilepath) - 1)) == -1)
-                *procfilepath = 0;
-            else
-                procfilepath[size] = 0;
-			__sync_fetch_and_or(&initialised, 2);
-		} else {
-			while (1 == initialised)
-				usleep(1000);
-		}
+    if (imms_once(&once)) {
+        if ((size = readlink("/proc/self/exe", procfilepath, sizeof(procfilepath) - 1)) == -1)
+            *procfilepath = 0;
+        else
+            procfilepath[size] = 0;
+        imms_once_done(&once);
 	}
 
     return *procfilepath ? procfilepath : NULL;
 }
 
+static uint64_t util_hash(uint64_t hash, const char *data, size_t len)
+{
+    while (len--)
+        hash = (hash ^ (unsigned char)*data++) * 1099511628211ULL;
+
+    return hash;
+}
+
+/* Reads a small file of /proc into buf as a string, returns its length */
+static ssize_t util_read_proc(const char *path, char *buf, size_t size)
+{
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if ((len = read(fd, buf, size - 1)) >= 0)
+        buf[len] = 0;
+    close(fd);
+
+    return len;
+}
+
+/* The avg60 of the "some" line of pressure stall information as a share of time, -1 if there is none */
+static double util_pressure(const char *buf)
+{
+    const char *sz;
+
+    if (strncmp(buf, "some", 4) || !(sz = strstr(buf, "avg60=")))
+        return -1;
+
+    return strtod(sz + 6, NULL) / 100;
+}
+
+/* Reads file of the cgroup directory at path into buf, false if the cgroup has no such file */
+static bool util_read_cgroup(char *path, size_t len, const char *file, char *buf, size_t size)
+{
+    bool ret;
+
+    snprintf(path + len, PATH_MAX + 1 - len, "/%s", file);
+    ret = util_read_proc(path, buf, size) > 0;
+    path[len] = 0;
+
+    return ret;
+}
+
+/**********************************************************************
+ * The budget of the process: the memory left under the tightest of
+ * memory.max of its cgroup v2 and the ancestors, the CPUs of the
+ * tightest cpu.max, and the pressure stall information of its cgroup.
+ * Without cgroup v2, limits or PSI, the host makes the budget. Nothing
+ * is allocated, the allocator may not be loaded yet.
+ **********************************************************************/
+bool imms_read_budget(imms_budget_t *budget)
+{
+    char path[PATH_MAX + 1], buf[4096], *sz, *end;
+    unsigned long long max, current, quota, period;
+    struct sysinfo info;
+    cpu_set_t cpus;
+    size_t len, root = strlen(IMMS_CGROUP_PATH);
+
+    if (sysinfo(&info))
+        return false;
+    /* MemAvailable counts the caches which can be dropped, freeram doesn't */
+    if (util_read_proc("/proc/meminfo", buf, sizeof(buf)) > 0 && (sz = strstr(buf, "MemAvailable:")))
+        budget->mem_free = strtoull(sz + 13, NULL, 10) * 1024;
+    else
+        budget->mem_free = info.freeram * info.mem_unit;
+    budget->cpus = sched_getaffinity(0, sizeof(cpus), &cpus) ? get_nprocs() : CPU_COUNT(&cpus);
+    budget->cpu_pressure = budget->mem_pressure = -1;
+    /* The cgroup v2 of the process is on the line of hierarchy 0 */
+    if (util_read_proc("/proc/self/cgroup", buf, sizeof(buf)) > 0 &&
+        (sz = !strncmp(buf, "0::", 3) ? buf : strstr(buf, "\n0::"))) {
+        sz += '\n' == *sz ? 4 : 3;
+        if ((end = strchr(sz, '\n')))
+            *end = 0;
+        snprintf(path, sizeof(path), "%s%s", IMMS_CGROUP_PATH, sz);
+        len = strlen(path);
+        while (len > root && '/' == path[len - 1])
+            path[--len] = 0;
+        if (util_read_cgroup(path, len, "cpu.pressure", buf, sizeof(buf)))
+            budget->cpu_pressure = util_pressure(buf);
+        if (util_read_cgroup(path, len, "memory.pressure", buf, sizeof(buf)))
+            budget->mem_pressure = util_pressure(buf);
+        /* A limit may be set on any ancestor, the tightest one counts */
+        for (;;) {
+            if (util_read_cgroup(path, len, "memory.max", buf, sizeof(buf)) && (max = strtoull(buf, &sz, 10)) && sz != buf &&
+                util_read_cgroup(path, len, "memory.current", buf, sizeof(buf))) {
+                current = strtoull(buf, NULL, 10);
+                if ((max > current ? max - current : 0) < budget->mem_free)
+                    budget->mem_free = max > current ? max - current : 0;
+            }
+            if (util_read_cgroup(path, len, "cpu.max", buf, sizeof(buf)) && (quota = strtoull(buf, &sz, 10)) && sz != buf &&
+                (period = strtoull(sz, NULL, 10)) && (double)quota / period < budget->cpus)
+                budget->cpus = (double)quota / period;
+            if (len <= root || !(sz = strrchr(path, '/')) || sz - path < root)
+                break;
+            *sz = 0;
+            len = sz - path;
+        }
+    }
+    if (budget->cpu_pressure < 0 && util_read_proc(IMMS_PRESSURE_PATH "cpu", buf, sizeof(buf)) > 0)
+        budget->cpu_pressure = util_pressure(buf);
+    if (budget->mem_pressure < 0 && util_read_proc(IMMS_PRESSURE_PATH "memory", buf, sizeof(buf)) > 0)
+        budget->mem_pressure = util_pressure(buf);
+    budget->cpu_load = info.loads[1] / 65536.0 / budget->cpus;
+
+    return true;
+}
+
+/* Marks the numbers of a sysfs list such as "0-3,8" in set, false if it isn't one */
+static bool util_parse_list(const char *sz, unsigned char *set, unsigned int max)
+{
+    unsigned long first, last;
+    char *end;
+
+    while (*sz && *sz != '\n') {
+        first = last = strtoul(sz, &end, 10);
+        if (end == sz)
+            return false;
+        if ('-' == *end && (last = strtoul(sz = end + 1, &end, 10), end == sz))
+            return false;
+        for (; first <= last && first < max; first++)
+            set[first] = 1;
+        sz = ',' == *end ? end + 1 : end;
+    }
+
+    return true;
+}
+
+/**********************************************************************
+ * The NUMA topology of the host read once from sysfs, NULL without
+ * node information. IMMS_SYSFS_ROOT in the environment replaces
+ * IMMS_SYSFS_PATH, so a topology can be faked on a single node host:
+ * <root>/devices/system/node/online and node<N>/cpulist are all read.
+ * It is ignored in setuid and setgid programs.
+ **********************************************************************/
+const imms_numa_t* imms_numa_topology()
+{
+    static imms_numa_t numa;
+    static int once = IMMS_ONCE_NONE;
+    unsigned char online[IMMS_NUMA_NODES_MAX] = {0}, cpus[IMMS_NUMA_CPUS_MAX];
+    char path[PATH_MAX + 1], buf[4096];
+    const char *root;
+    unsigned int i, j;
+
+    if (imms_once(&once)) {
+        root = (root = secure_getenv("IMMS_SYSFS_ROOT")) && *root ? root : IMMS_SYSFS_PATH;
+        snprintf(path, sizeof(path), "%s/devices/system/node/online", root);
+        if (util_read_proc(path, buf, sizeof(buf)) > 0 && util_parse_list(buf, online, IMMS_NUMA_NODES_MAX)) {
+            for (i = 0; i < IMMS_NUMA_NODES_MAX; i++) {
+                if (!online[i])
+                    continue;
+                numa.node[numa.nnodes++] = i;
+                memset(cpus, 0, sizeof(cpus));
+                snprintf(path, sizeof(path), "%s/devices/system/node/node%u/cpulist", root, i);
+                if (util_read_proc(path, buf, sizeof(buf)) >= 0 && util_parse_list(buf, cpus, IMMS_NUMA_CPUS_MAX)) {
+                    for (j = 0; j < IMMS_NUMA_CPUS_MAX; j++) {
+                        if (cpus[j])
+                            numa.cpu_node[j] = i;
+                    }
+                }
+            }
+        }
+        imms_once_done(&once);
+    }
+
+    return numa.nnodes ? &numa : NULL;
+}
+
+/* The key of the perf-res record of the process: its path, and a hash of what its policy rule keys on after '#' */
+char* imms_process_key()
+{
+    static char key[PATH_MAX + 1] = {0};
+    static char buf[8192];
+    static int once = IMMS_ONCE_NONE;
+    const imms_policy_rule_t *rule;
+    uint64_t hash = 14695981039346656037ULL;
+    char *procfilepath, *sz;
+    unsigned int i;
+    ssize_t len;
+
+    if (imms_once(&once)) {
+        if ((procfilepath = imms_process_filepath())) {
+            strcpy(key, procfilepath);
+            rule = imms_policy_lookup(procfilepath);
+            if (rule && (rule->key_argv || (rule->flags & IMMS_POLICY_KEY_CGROUP) || *rule->key_env)) {
+                /* The arguments are separated by their terminating zeros */
+                if (rule->key_argv && (len = util_read_proc("/proc/self/cmdline", buf, sizeof(buf))) > 0) {
+                    for (i = 0, sz = buf; sz < buf + len && i < IMMS_POLICY_KEY_ARGV_MAX; i++, sz += strlen(sz) + 1) {
+                        if (rule->key_argv & (1u << i))
+                            hash = util_hash(hash, sz, strlen(sz) + 1);
+                    }
+                }
+                if ((rule->flags & IMMS_POLICY_KEY_CGROUP) && (len = util_read_proc("/proc/self/cgroup", buf, sizeof(buf))) > 0)
+                    hash = util_hash(hash, buf, len);
+                if (*rule->key_env && (sz = getenv(rule->key_env)))
+                    hash = util_hash(hash, sz, strlen(sz) + 1);
+                len = strlen(key);
+                snprintf(key + len, sizeof(key) - len, "#%016llx", (unsigned long long)hash);
+            }
+        }
+        imms_once_done(&once);
+    }
+
+    return *key ? key : NULL;
+}
+
 bool imms_open_perf_log_file(char *szfile, const size_t len, const char *szdir)
 {
     char *sz, filepath[PATH_MAX + 1], filename[NAME_MAX + 1], c;
@@ -253,7 +485,8 @@ void imms_log_error(const char *sz)
 {
 	static char filename[PATH_MAX + 1] = {0};
 	static sem_t mutex;
-	static char initialised = 0;
+	static int once = IMMS_ONCE_NONE;
+	static bool sem_ok = false;
 	int fd;
 	char sztime[32];
 	time_t t;
@@ -261,14 +494,11 @@ void imms_log_error(const char *sz)
 
 	if (!sz)
 		return;
-	if (initialised != 3) {
-		if (!__sync_fetch_and_or(&initialised, 1))
-			__sync_fetch_and_or(&initialised, sem_init(&mutex, 0, 1) == -1 ? 4 : 2);
-		else
-			while (1 == initialised)
-				usleep(1000);
+	if (imms_once(&once)) {
+		sem_ok = sem_init(&mutex, 0, 1) != -1;
+		imms_once_done(&once);
 	}
-	if (5 == initialised)
+	if (!sem_ok)
 		return;
 	sem_wait(&mutex);
 	if (!filename[0])
@@ -371,17 +601,21 @@ void imms_init_daemon(char *dname)
 
 bool imms_is_process_excluded()
 {
+    const imms_policy_rule_t *rule;
     char *procfilepath;
     bool is_excluded = false;
     int fd;
 
-    fd = open(IMMS_PATH "excluded-bins", O_RDONLY);
+    if (!(procfilepath = imms_process_filepath()))
+        return false;
+    /* excluded-bins is only scanned until immsd has compiled it into the policy */
+    if (imms_policy_available())
+        return (rule = imms_policy_lookup(procfilepath)) && (rule->flags & IMMS_POLICY_EXCLUDE);
+    fd = open(IMMS_POLICY_EXCLUDED_FILE, O_RDONLY);
     if (-1 == fd) {
         imms_log_error("imms_is_process_excluded open error!");
         return false;
     }
-    if (!(procfilepath = imms_process_filepath()))
-        goto ret;
     for (;;) {
         char c; int i;
         for (i = 0, c = is_excluded = 1; c; i++) {
@@ -426,77 +660,127 @@ long double imms_average(long double avg, long double add, long double count)
     return imms_average_winc(avg, add, count, 1);
 }
 
-void imms_share_info(imms_library_t lib, bool test_mode)
+/* Reads a perf-res record at the current offset, records in the older layouts are converted */
+bool imms_read_perf_result(int fd, imms_perf_result_t *perfres)
 {
-    key_t key = 'i' << 24 | 'm' << 16 | 'm' << 8 | 's';
-    imms_shared_info_t *pshared_info;
-    int segid;
+    static const char *v0_names[] = {"System", "Hoard", "TCMalloc", "jemalloc"};
+    const size_t header = offsetof(imms_perf_result_t, fingerprinted);
+    imms_perf_result_v0_t v0;
+    off_t pos;
+    ssize_t size;
+    unsigned int i;
 
-    key += getpid();
-    segid = shmget(key, sizeof(*pshared_info), IPC_CREAT | IPC_EXCL | 0644);
-    if (-1 == segid)
-        return;
-    pshared_info = shmat(segid, NULL, 0);
-    if (pshared_info == (void*)-1)
-        return;
-    pshared_info->lib = lib;
-    pshared_info->test_mode = test_mode;
-    shmdt(pshared_info);
+    if (-1 == (pos = lseek(fd, 0, SEEK_CUR)))
+        return false;
+    memset(perfres, 0, sizeof(*perfres));
+    if (read(fd, perfres, header) == header && IMMS_PERF_RES_MAGIC == perfres->magic) {
+        if (perfres->nlibs > IMMS_MALLOC_LIB_MAX || perfres->version > IMMS_PERF_RES_VERSION)
+            return false;
+        /* Records before version 3 have no fingerprint */
+        size = offsetof(imms_perf_result_t, smr) - header;
+        if (perfres->version >= 3 ? read(fd, (char*)perfres + header, size) != size :
+            lseek(fd, pos + offsetof(imms_perf_result_v2_t, smr), SEEK_SET) == -1)
+            return false;
+        if (IMMS_PERF_RES_VERSION == perfres->version) {
+            size = perfres->nlibs * sizeof(perfres->smr[0]);
+            return read(fd, perfres->smr, size) == size;
+        }
+        /* Summaries end before the locality before version 6, the threads before 5, the peak before 4, the variance in 1 */
+        size = perfres->version >= 5 ? offsetof(imms_perf_summary_t, remote) :
+               perfres->version >= 4 ? offsetof(imms_perf_summary_t, threads) :
+               perfres->version >= 2 ? offsetof(imms_perf_summary_t, peakmem) : offsetof(imms_perf_summary_t, sec_m2);
+        for (i = 0; i < perfres->nlibs; i++) {
+            if (read(fd, &perfres->smr[i], size) != size)
+                return false;
+        }
+        perfres->version = IMMS_PERF_RES_VERSION;
+        return true;
+    }
+    if (lseek(fd, pos, SEEK_SET) != pos || read(fd, &v0, sizeof(v0)) != sizeof(v0))
+        return false;
+    memset(perfres, 0, sizeof(*perfres));
+    perfres->magic = IMMS_PERF_RES_MAGIC;
+    perfres->version = IMMS_PERF_RES_VERSION;
+    perfres->nlibs = 4;
+    for (i = 0; i < 4; i++) {
+        strcpy(perfres->smr[i].name, v0_names[i]);
+        perfres->smr[i].sec = v0.smr[i].sec;
+        perfres->smr[i].memfrag = v0.smr[i].memfrag;
+        perfres->smr[i].avgmem = v0.smr[i].avgmem;
+        perfres->smr[i].count = v0.smr[i].count;
+        perfres->smr[i].time = v0.smr[i].time;
+    }
+    memcpy(perfres->result, v0.result, sizeof(perfres->result));
+    perfres->nextlib = v0.nextlib;
+    perfres->test_mode = v0.test_mode;
+
+    return true;
 }
 
-imms_shared_info_t imms_read_shared_info(pid_t pid)
+bool imms_write_perf_result(int fd, const imms_perf_result_t *perfres)
 {
-    key_t key = 'i' << 24 | 'm' << 16 | 'm' << 8 | 's';
-    imms_shared_info_t shared_info = {0}, *pshared_info;
-    int segid;
-
-    key += pid;
-    segid = shmget(key, sizeof(*pshared_info), S_IRUSR);
-    if (-1 == segid)
-        return shared_info;
-    pshared_info = shmat(segid, NULL, SHM_RDONLY);
-    if (pshared_info == (void*)-1)
-        return shared_info;
-    shared_info = *pshared_info;
-    shmdt(pshared_info);
-
-    return shared_info;
+    size_t size = offsetof(imms_perf_result_t, smr) + perfres->nlibs * sizeof(perfres->smr[0]);
+
+    return write(fd, perfres, size) == size;
 }
 
-size_t imms_get_mem_usage(pid_t pid, bool self)
+/* Returns the index of the named summary, -1 if it doesn't exist and add is false or there is no room */
+int imms_find_perf_summary(imms_perf_result_t *perfres, const char *name, bool add)
 {
-    int fd;
-    char buf[PATH_MAX + 128];
-    char *offset, *length, *perm, *name;
     unsigned int i;
-    size_t mem = 0;
 
-    if (self) {
-        fd = open("/proc/self/maps", O_RDONLY);
-    } else {
-        snprintf(buf, sizeof(buf), "/proc/%u/maps", pid);
-        fd = open(buf, O_RDONLY);
+    for (i = 0; i < perfres->nlibs; i++) {
+        if (!strncmp(perfres->smr[i].name, name, IMMS_MALLOC_LIB_NAME_MAX))
+            return i;
     }
-    if (-1 == fd)
-        return 0;
-    for (;;) {
-        i = 0;
-        do {
-            if (read(fd, &buf[i], 1) != 1)
-                goto ret;
-        } while ((buf[i] != '\n') && (buf[i] != '\r') && (++i < (sizeof(buf) - 1)));
-        buf[i] = 0;
-        offset = buf;
-        length = strchr(buf, '-') + 1;
-        perm = strchr(length, ' ') + 1;
-        if (!strncmp(perm, "rw-p", 4)) {
-            name = strrchr(buf, ' ') + 1;
-            if (!*name || !strncmp(name, "[heap]", 6))
-                mem += strtoull(length, NULL, 16) - strtoull(offset, NULL, 16);
-        }
+    if (!add || IMMS_MALLOC_LIB_MAX == perfres->nlibs)
+        return -1;
+    memset(&perfres->smr[i], 0, sizeof(perfres->smr[i]));
+    strncpy(perfres->smr[i].name, name, IMMS_MALLOC_LIB_NAME_MAX - 1);
+    perfres->nlibs++;
+
+    return i;
+}
+
+/* Opens /proc/<pid>/<file> for imms_read_mem_usage, which rereads it with a single syscall */
+int imms_open_mem_usage(pid_t pid, const char *file)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Parses smaps_rollup or the cheaper statm, which leaves swap as it is */
+bool imms_read_mem_usage(int fd, imms_mem_usage_t *usage)
+{
+    static long page_size;
+    unsigned long size, resident, shared;
+    char buf[4096], *line;
+    ssize_t len;
+
+    if ((len = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+        return false;
+    buf[len] = 0;
+    if (!strstr(buf, "Rss:")) {
+        if (sscanf(buf, "%lu %lu %lu", &size, &resident, &shared) != 3)
+            return false;
+        if (!page_size)
+            page_size = sysconf(_SC_PAGESIZE);
+        /* Shared pages are file and shmem pages, the rest is anonymous */
+        usage->rss = resident * page_size;
+        usage->anon = (resident - shared) * page_size;
+        return true;
+    }
+    for (line = buf; line; line = (line = strchr(line, '\n')) ? line + 1 : NULL) {
+        if (!strncmp(line, "Rss:", 4))
+            usage->rss = strtoul(line + 4, NULL, 10) * 1024;
+        else if (!strncmp(line, "Anonymous:", 10))
+            usage->anon = strtoul(line + 10, NULL, 10) * 1024;
+        else if (!strncmp(line, "Swap:", 5))
+            usage->swap = strtoul(line + 5, NULL, 10) * 1024;
     }
 
-ret:
-    close(fd);
-    return mem;
+    return usage->rss != 0;
 }
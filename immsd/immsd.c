@@ -17,79 +17,1033 @@
  * along with IMMS. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include "../imms/perf.h"
 
-#define SLEEP_TIME                  5       /* Process files in every SLEEP_TIME seconds */
-#define MIN_TIME_TO_REPER           (1 * 60 * 60)      /* 1 hour in seconds */
-#define MAX_TEST_AMOUNT             5      /* Maximum test amount per memory allocator */
+#define SLEEP_TIME                  5       /* Sample the running processes in every SLEEP_TIME seconds */
+#define MEM_SAMPLE_TIME             1       /* and their memory in every MEM_SAMPLE_TIME seconds */
+#define MIN_TIME_TO_REPERF          (1 * 60 * 60)      /* 1 hour in seconds */
+#define MIN_TEST_AMOUNT             2      /* Runs of an allocator before its variance tells anything */
+#define MAX_TEST_AMOUNT             20     /* Maximum test amount per memory allocator */
+#define SEPARATION_Z                2.0    /* An allocator worse than the best by this many standard errors is out */
+#define KNN_NEIGHBOURS              3      /* Tuned binaries an unseen binary takes its allocators from */
+#define KNN_MAX_DISTANCE            0.5    /* Binaries further apart than this have nothing in common */
+#define MIN_CONTENDED_THREADS       4      /* With fewer threads at once, contention doesn't rank the allocators */
+#define MAX_TEST_TIME               (10 * 60)          /* A running process tests an allocator for 10 minutes */
+#define SLOW_LOCK_SPINS             1000
+#define MAX_WORKERS                 16      /* Perf logs are analysed by a worker per core, up to MAX_WORKERS */
+
+/* Latency in seconds that pct of the calls in the histograms don't exceed */
+static double immsd_hist_percentile(double hist[][IMMS_PERF_HIST_BUCKETS], double pct)
+{
+    double total = 0, sum = 0;
+    unsigned int i, j;
+
+    for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++) {
+        for (j = 0; j < IMMS_PERF_HIST_BUCKETS; j++)
+            total += hist[i][j];
+    }
+    if (!total)
+        return 0;
+    for (j = 0; j < IMMS_PERF_HIST_BUCKETS; j++) {
+        for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++)
+            sum += hist[i][j];
+        if (sum >= total * pct)
+            break;
+    }
+    /* The last bucket has no upper bound, report where it starts */
+    if (j >= IMMS_PERF_HIST_BUCKETS - 1)
+        return imms_perf_hist_nsec(IMMS_PERF_HIST_BUCKETS - 1) / 1000000000.0;
+
+    return imms_perf_hist_nsec(j + 1) / 1000000000.0;
+}
+
+/* Share of the calls in the histograms which left the fast path, see IMMS_PERF_CONTENDED_NSEC */
+static double immsd_contention(unsigned long hist[][IMMS_PERF_HIST_BUCKETS])
+{
+    double total = 0, slow = 0;
+    unsigned int i, j;
+
+    for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++) {
+        for (j = 0; j < IMMS_PERF_HIST_BUCKETS; j++) {
+            total += hist[i][j];
+            if (j >= imms_perf_hist_bucket(IMMS_PERF_CONTENDED_NSEC))
+                slow += hist[i][j];
+        }
+    }
+
+    return total ? slow / total : 0;
+}
 
 /**********************************************************************
  * At return:
  * perfres->result[0] stores the fastest library
  * perfres->result[1] stores the most memory efficient library
- * perfres->result[2] stores the balanced library for CPU and memory
+ * perfres->result[2] stores the balanced library for CPU, tail latency and memory,
+ * and for contention too when the binary runs MIN_CONTENDED_THREADS threads at once
  **********************************************************************/
 static void immsd_analyse(imms_perf_result_t *perfres)
 {
-    imms_library_t sorted_libs[2][IMMS_MALLOC_LIB_END + 1];
-    imms_library_t ranked_libs[2][IMMS_MALLOC_LIB_END + 1];
-    imms_library_t i, j, k, tmp;
+    imms_library_t libs[IMMS_MALLOC_LIB_MAX];
+    imms_library_t sorted_libs[4][IMMS_MALLOC_LIB_MAX];
+    imms_library_t ranked_libs[4][IMMS_MALLOC_LIB_MAX];
+    imms_library_t i, j, k, m, n, tmp;
+    double value[4][IMMS_MALLOC_LIB_MAX];
 
-    /* first index of the sorted libs holds the performance and fragmentation, respectively */
+    /* Only the libraries which were measured at least once take part */
+    for (i = n = 0, m = 3; i < perfres->nlibs; i++) {
+        if (perfres->smr[i].count) {
+            libs[n++] = i;
+            if (perfres->smr[i].threads >= MIN_CONTENDED_THREADS)
+                m = 4;
+        }
+    }
+    if (!n)
+        return;
+    /* first index of the sorted libs holds the performance, fragmentation, tail latency and contention, respectively */
     /* library values are assigned to the array; later, they will be sorted by rank which is held in second index */
-    for (i = 0; i < 2; i++) {
-        for (j = 0; j <= IMMS_MALLOC_LIB_END; j++)
+    for (j = 0; j < n; j++) {
+        value[0][j] = perfres->smr[libs[j]].sec;
+        value[1][j] = perfres->smr[libs[j]].memfrag;
+        value[2][j] = perfres->smr[libs[j]].p99;
+        value[3][j] = perfres->smr[libs[j]].contention;
+        for (i = 0; i < m; i++)
             sorted_libs[i][j] = j;
     }
     /* sorting operation by rank (j) */
-    for (i = 0; i < IMMS_MALLOC_LIB_END; i++) {
-        for (j = i + 1; j <= IMMS_MALLOC_LIB_END; j++) {
-            if (perfres->smr[sorted_libs[0][i]].sec < perfres->smr[sorted_libs[0][j]].sec) {
-                tmp = sorted_libs[0][i];
-                sorted_libs[0][i] = sorted_libs[0][j];
-                sorted_libs[0][j] = tmp;
-            }
-            if (perfres->smr[sorted_libs[1][i]].memfrag < perfres->smr[sorted_libs[1][j]].memfrag) {
-                tmp = sorted_libs[1][i];
-                sorted_libs[1][i] = sorted_libs[1][j];
-                sorted_libs[1][j] = tmp;
+    for (i = 0; i < n - 1; i++) {
+        for (j = i + 1; j < n; j++) {
+            for (k = 0; k < m; k++) {
+                if (value[k][sorted_libs[k][i]] < value[k][sorted_libs[k][j]]) {
+                    tmp = sorted_libs[k][i];
+                    sorted_libs[k][i] = sorted_libs[k][j];
+                    sorted_libs[k][j] = tmp;
+                }
             }
         }
     }
-    perfres->result[0] = sorted_libs[0][IMMS_MALLOC_LIB_END];
-    perfres->result[1] = sorted_libs[1][IMMS_MALLOC_LIB_END];
     /* Rank libraries and select balanced library */
-    perfres->result[2] = 0;
-    for (i = 0; i <= IMMS_MALLOC_LIB_END; i++) {
-        for (j = 0; j <= IMMS_MALLOC_LIB_END; j++) {
-            for (k = 0; k < 2; k++) {
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            for (k = 0; k < m; k++) {
                 if (i == sorted_libs[k][j])
                     ranked_libs[k][i] = j + 1;    /* j + 1 is rank of the library */
             }
         }
-        j = ranked_libs[0][perfres->result[2]] + ranked_libs[1][perfres->result[2]];
-        k = ranked_libs[0][i] + ranked_libs[1][i];
+    }
+    for (i = 1, tmp = 0; i < n; i++) {
+        j = ranked_libs[0][tmp] + ranked_libs[1][tmp] + ranked_libs[2][tmp] + (m > 3 ? ranked_libs[3][tmp] : 0);
+        k = ranked_libs[0][i] + ranked_libs[1][i] + ranked_libs[2][i] + (m > 3 ? ranked_libs[3][i] : 0);
         if (k > j) {
-            perfres->result[2] = i;
+            tmp = i;
         } else if (j == k) {
             /* if two libraries have same ranking then select more memory efficient one */
-            if (ranked_libs[1][i] > ranked_libs[1][perfres->result[2]])
-                perfres->result[2] = i;
+            if (ranked_libs[1][i] > ranked_libs[1][tmp])
+                tmp = i;
+        }
+    }
+    perfres->result[0] = libs[sorted_libs[0][n - 1]];
+    perfres->result[1] = libs[sorted_libs[1][n - 1]];
+    perfres->result[2] = libs[tmp];
+}
+
+/* The policy rule of the binary of a record key, which may end with the hash of a workload */
+static const imms_policy_rule_t* immsd_policy_rule(const char *key)
+{
+    char path[PATH_MAX + 1], *sz;
+
+    strcpy(path, key);
+    if ((sz = strrchr(path, '#')) && !strchr(sz, '/'))
+        *sz = 0;
+
+    return imms_policy_lookup(path);
+}
+
+/**********************************************************************
+ * Puts the allocator which meets the objective of rule best into all
+ * the results: the lowest weighted sum of the metrics relative to their
+ * means among the allocators within the limits, or the one exceeding
+ * the limits least. Returns false if rule has no objective.
+ **********************************************************************/
+static bool immsd_optimise(imms_perf_result_t *perfres, const imms_policy_rule_t *rule)
+{
+    double metric[IMMS_MALLOC_LIB_MAX][IMMS_POLICY_METRICS], mean[IMMS_POLICY_METRICS] = {0};
+    double score, excess, best = 0, best_excess = 0;
+    imms_library_t libs[IMMS_MALLOC_LIB_MAX];
+    unsigned int i, j, n, winner = 0;
+
+    for (j = 0; rule && j < IMMS_POLICY_METRICS && !rule->objective[j]; j++);
+    if (!rule || j == IMMS_POLICY_METRICS)
+        return false;
+    for (i = n = 0; i < perfres->nlibs; i++) {
+        if (!perfres->smr[i].count)
+            continue;
+        metric[n][IMMS_POLICY_METRIC_TIME] = perfres->smr[i].sec;
+        metric[n][IMMS_POLICY_METRIC_P99] = perfres->smr[i].p99;
+        metric[n][IMMS_POLICY_METRIC_MEMFRAG] = perfres->smr[i].memfrag;
+        metric[n][IMMS_POLICY_METRIC_RSS] = perfres->smr[i].avgmem;
+        metric[n][IMMS_POLICY_METRIC_PEAK] = perfres->smr[i].peakmem;
+        metric[n][IMMS_POLICY_METRIC_CONTENTION] = perfres->smr[i].contention;
+        metric[n][IMMS_POLICY_METRIC_REMOTE] = perfres->smr[i].remote;
+        for (j = 0; j < IMMS_POLICY_METRICS; j++)
+            mean[j] = imms_average(mean[j], metric[n][j], n);
+        libs[n++] = i;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0, score = excess = 0; j < IMMS_POLICY_METRICS; j++) {
+            if (mean[j] > 0)
+                score += rule->objective[j] * metric[i][j] / mean[j];
+            if (rule->limit[j] > 0 && metric[i][j] > rule->limit[j])
+                excess += metric[i][j] / rule->limit[j] - 1;
+        }
+        if (!i || excess < best_excess || (excess == best_excess && score < best)) {
+            winner = i;
+            best = score;
+            best_excess = excess;
+        }
+    }
+    if (n)
+        perfres->result[0] = perfres->result[1] = perfres->result[2] = libs[winner];
+
+    return true;
+}
+
+/* Standard error of the mean of the runs, -1 while they are too few to tell */
+static double immsd_std_error(double m2, size_t n)
+{
+    return n < MIN_TEST_AMOUNT ? -1 : sqrt(m2 / (n - 1) / n);
+}
+
+/* Whether mean is worse than best by more than SEPARATION_Z standard errors of their difference */
+static bool immsd_separated(double mean, double se, double best, double best_se)
+{
+    if (se < 0 || best_se < 0)
+        return false;
+
+    return mean - best > SEPARATION_Z * sqrt(se * se + best_se * best_se);
+}
+
+/* A draw of the normal distribution, by the Box-Muller transform */
+static double immsd_gaussian(unsigned int *seed)
+{
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0), v = rand_r(seed) / (RAND_MAX + 1.0);
+
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/**********************************************************************
+ * Chooses perfres->nextlib by Thompson sampling. An allocator with less
+ * than MIN_TEST_AMOUNT runs is tested first, round-robin after lib, or
+ * by the votes of immsd_predict if there are any: the most voted first,
+ * then the others once, and to MIN_TEST_AMOUNT only if they beat the
+ * best ones.
+ * The others draw their CPU time and fragmentation from the normal
+ * distribution of their means, relative to the best ones; the lowest
+ * draw is tested next. An allocator separated from the best in both is
+ * not tested anymore, and the best one of either is tested only while
+ * another is not separated from it in that one, so exploration stops
+ * once a single winner is left or MAX_TEST_AMOUNT is reached.
+ * perfres->test_mode tells if there is a library to test.
+ **********************************************************************/
+static void immsd_schedule(imms_perf_result_t *perfres, char registered[][IMMS_MALLOC_LIB_NAME_MAX], size_t nregistered, int lib, time_t t,
+                           const double vote[])
+{
+    static __thread unsigned int seed;
+    imms_perf_summary_t *smr = perfres->smr;
+    bool measured[IMMS_MALLOC_LIB_MAX], candidate[IMMS_MALLOC_LIB_MAX], contended[2] = {false, false}, rival[2];
+    double se[2][IMMS_MALLOC_LIB_MAX], score, best_vote = -1, best_score = HUGE_VAL;
+    int fastest = -1, leanest = -1;
+    size_t i, j;
+
+    if (!seed)
+        seed = t ^ (unsigned int)pthread_self();
+    perfres->test_mode = false;
+    for (i = 0; i < perfres->nlibs; i++) {
+        /* Libraries removed from the registry keep their results but aren't tested anymore */
+        for (j = 0; j < nregistered && strncmp(registered[j], smr[i].name, IMMS_MALLOC_LIB_NAME_MAX); j++);
+        if (!(measured[i] = j < nregistered && smr[i].count))
+            continue;
+        se[0][i] = immsd_std_error(smr[i].sec_m2, smr[i].nvar);
+        se[1][i] = immsd_std_error(smr[i].memfrag_m2, smr[i].nvar);
+        if (fastest == -1 || smr[i].sec < smr[fastest].sec)
+            fastest = i;
+        if (leanest == -1 || smr[i].memfrag < smr[leanest].memfrag)
+            leanest = i;
+    }
+    for (i = 0, lib++; i < perfres->nlibs; i++, lib++) {
+        lib %= perfres->nlibs;
+        for (j = 0; j < nregistered && strncmp(registered[j], smr[lib].name, IMMS_MALLOC_LIB_NAME_MAX); j++);
+        if (j == nregistered || smr[lib].nvar >= MIN_TEST_AMOUNT || smr[lib].count >= MAX_TEST_AMOUNT ||
+            difftime(t, smr[lib].time) < MIN_TIME_TO_REPERF)
+            continue;
+        if (!vote) {
+            perfres->nextlib = lib;
+            perfres->test_mode = true;
+            return;
+        }
+        /* A library no neighbour chose gets a single run, and the others only if it beat the best so far */
+        if ((score = vote[lib]) <= 0 && smr[lib].nvar && lib != fastest && lib != leanest)
+            continue;
+        if (score > best_vote) {
+            best_vote = score;
+            perfres->nextlib = lib;
+            perfres->test_mode = true;
+        }
+    }
+    if (perfres->test_mode)
+        return;
+    /* An allocator is never separated from itself, the best ones are tested only against contenders */
+    for (i = 0; i < perfres->nlibs; i++) {
+        candidate[i] = measured[i] && smr[i].nvar >= MIN_TEST_AMOUNT && smr[i].count < MAX_TEST_AMOUNT &&
+                       difftime(t, smr[i].time) >= MIN_TIME_TO_REPERF;
+        if (!candidate[i] || i == fastest || i == leanest)
+            continue;
+        if (!immsd_separated(smr[i].sec, se[0][i], smr[fastest].sec, se[0][fastest]))
+            contended[0] = true;
+        else if (immsd_separated(smr[i].memfrag, se[1][i], smr[leanest].memfrag, se[1][leanest]))
+            candidate[i] = false;
+        if (!immsd_separated(smr[i].memfrag, se[1][i], smr[leanest].memfrag, se[1][leanest]))
+            contended[1] = true;
+    }
+    /* The fastest and the leanest may contend with each other in the metric of the other one */
+    if (fastest != -1 && fastest != leanest) {
+        rival[0] = candidate[leanest] && !immsd_separated(smr[leanest].sec, se[0][leanest], smr[fastest].sec, se[0][fastest]);
+        rival[1] = candidate[fastest] && !immsd_separated(smr[fastest].memfrag, se[1][fastest], smr[leanest].memfrag, se[1][leanest]);
+        candidate[fastest] = candidate[fastest] && (contended[0] || rival[0] || rival[1]);
+        candidate[leanest] = candidate[leanest] && (contended[1] || rival[0] || rival[1]);
+    } else if (fastest != -1) {
+        candidate[fastest] = candidate[fastest] && (contended[0] || contended[1]);
+    }
+    for (i = 0; i < perfres->nlibs; i++) {
+        if (!candidate[i])
+            continue;
+        score = (smr[i].sec + immsd_gaussian(&seed) * se[0][i]) / (smr[fastest].sec > 0 ? smr[fastest].sec : 1) +
+                (smr[i].memfrag + immsd_gaussian(&seed) * se[1][i]) / (smr[leanest].memfrag > 0 ? smr[leanest].memfrag : 1);
+        if (score < best_score) {
+            best_score = score;
+            perfres->nextlib = i;
+            perfres->test_mode = true;
+        }
+    }
+}
+
+/* Features of the workload in a perf log, see imms_perf_result_t; false if it has no allocations */
+static bool immsd_fingerprint(const imms_perf_log_t *perf_log, long double real_mem, double feature[])
+{
+    double allocs = 0, reallocs = 0, frees = 0, calls;
+    unsigned int i;
+
+    memset(feature, 0, IMMS_PERF_FEATURES * sizeof(feature[0]));
+    for (i = 0; i < IMMS_PERF_SIZE_CLASSES; i++) {
+        calls = perf_log->size[IMMS_PERF_MALLOC][i].calls + perf_log->size[IMMS_PERF_CALLOC][i].calls +
+                perf_log->size[IMMS_PERF_MEMALIGN][i].calls;
+        feature[i * IMMS_PERF_SIZE_BANDS / IMMS_PERF_SIZE_CLASSES] += calls;
+        allocs += calls;
+        reallocs += perf_log->size[IMMS_PERF_REALLOC][i].calls;
+        frees += perf_log->size[IMMS_PERF_FREE][i].calls;
+    }
+    if (!allocs)
+        return false;
+    for (i = 0; i < IMMS_PERF_SIZE_BANDS; i++)
+        feature[i] /= allocs;
+    feature[i++] = allocs / (allocs + frees);
+    feature[i++] = reallocs / (allocs + reallocs + frees);
+    /* The threads at once tell the concurrency better than those which ever allocated */
+    feature[i++] = fmin(log2(1 + (perf_log->threads_peak ? perf_log->threads_peak : perf_log->threads)) / log2(1 + IMMS_PERF_SLOTS), 1);
+    feature[i] = fmin(log2(1 + real_mem) / 48, 1);      /* 256 TB */
+
+    return true;
+}
+
+/**********************************************************************
+ * Finds the tuned binaries with the KNN_NEIGHBOURS nearest fingerprints
+ * in the perf-res index. A binary is tuned once its balanced library has
+ * MIN_TEST_AMOUNT runs. Every registered library gets the votes of the
+ * neighbours which chose it, the closer ones weighing more, so that
+ * immsd_schedule tests them first. The results of an unseen binary are
+ * set by the votes per result. Returns false if there is no binary
+ * within KNN_MAX_DISTANCE.
+ **********************************************************************/
+static bool immsd_predict(imms_perf_result_t *perfres, char registered[][IMMS_MALLOC_LIB_NAME_MAX], size_t nregistered,
+                          const char *procpath, bool unseen, double vote[])
+{
+    static __thread imms_perf_res_entry_t entry;
+    char names[KNN_NEIGHBOURS][3][IMMS_MALLOC_LIB_NAME_MAX];
+    double dist[KNN_NEIGHBOURS], d, weight, best;
+    unsigned int i, j, k, n = 0, chosen, slot;
+    int lib;
+
+    if (!perfres->fingerprinted)
+        return false;
+    for (slot = 0; slot < IMMS_PERF_RES_INDEX_SLOTS; slot++) {
+        if (!imms_perf_res_entry(slot, &entry) || !strncmp(entry.path, procpath, PATH_MAX) ||
+            !entry.fingerprinted || !*entry.lib[2] || entry.nvar < MIN_TEST_AMOUNT)
+            continue;
+        for (i = 0, d = 0; i < IMMS_PERF_FEATURES; i++)
+            d += (entry.fingerprint[i] - perfres->fingerprint[i]) * (entry.fingerprint[i] - perfres->fingerprint[i]);
+        d = sqrt(d);
+        /* Insertion into the nearest ones so far */
+        if (n < KNN_NEIGHBOURS || d < dist[KNN_NEIGHBOURS - 1]) {
+            for (i = n < KNN_NEIGHBOURS ? n++ : KNN_NEIGHBOURS - 1; i && dist[i - 1] > d; i--) {
+                dist[i] = dist[i - 1];
+                memcpy(names[i], names[i - 1], sizeof(names[i]));
+            }
+            dist[i] = d;
+            for (k = 0; k < 3; k++)
+                memcpy(names[i][k], *entry.lib[k] ? entry.lib[k] : entry.lib[2], IMMS_MALLOC_LIB_NAME_MAX);
+        }
+    }
+    if (!n || dist[0] > KNN_MAX_DISTANCE)
+        return false;
+    for (k = 0; k < 3; k++) {
+        for (i = 0, best = 0, chosen = n; i < n; i++) {
+            /* Libraries removed from the registry aren't chosen */
+            for (j = 0; j < nregistered && strncmp(registered[j], names[i][k], IMMS_MALLOC_LIB_NAME_MAX); j++);
+            if (j == nregistered || (lib = imms_find_perf_summary(perfres, names[i][k], false)) == -1)
+                continue;
+            /* The balanced choice weighs the most in the votes */
+            vote[lib] += (k == 2 ? 2 : 1) / (dist[i] + 0.001);
+            for (j = 0, weight = 0; j < n; j++) {
+                if (!strncmp(names[i][k], names[j][k], IMMS_MALLOC_LIB_NAME_MAX))
+                    weight += 1 / (dist[j] + 0.001);
+            }
+            if (weight > best) {
+                best = weight;
+                chosen = i;
+            }
+        }
+        if (unseen && chosen < n && (lib = imms_find_perf_summary(perfres, names[chosen][k], false)) != -1)
+            perfres->result[k] = lib;
+    }
+
+    return true;
+}
+
+/* A process publishing its counters in IMMS_SHARED_PATH, and the perf log immsd writes for it */
+typedef struct immsd_process {
+    struct immsd_process *next;
+    char name[NAME_MAX + 1];
+    int fd;                         /* Flocked by the process while it runs */
+    int pidfd;                      /* Readable once the process has exited, closed at that event */
+    imms_perf_shared_t *shared;
+    pid_t pid;                      /* Of the file name, checked against /proc */
+    char path[PATH_MAX + 1];        /* Key of the perf-res record, checked against the binary */
+    int statm_fd;                   /* Read every MEM_SAMPLE_TIME */
+    int rollup_fd;                  /* Read every SLEEP_TIME for swap, -1 if the kernel has no smaps_rollup */
+    imms_mem_usage_t mem;
+    int log_fd;                     /* -1 while there is no log */
+    char log_path[PATH_MAX + 1];
+    char log_lib[IMMS_MALLOC_LIB_NAME_MAX];
+    off_t log_pos;
+    off_t log_end;                  /* Memory samples are appended here */
+    time_t log_time;
+    bool logged;                    /* Counters gathered between two logs are dropped */
+    bool log_native;                /* The log's allocated memory is the allocators' own, see immsd_write_mem_sample */
+    bool rotated;                   /* The log was closed for analysis, wait until the process acts on it */
+    unsigned int rotated_seq;       /* swap_seq when the log was closed; the analysis bumps it */
+    unsigned int placement_seen;    /* placement_next when the placements were last located */
+    struct timespec cputime;
+    imms_perf_log_t perf_log;
+} immsd_process_t;
+
+/* A perf log waiting for analysis */
+typedef struct immsd_job {
+    struct immsd_job *next;
+    char path[PATH_MAX + 1];
+} immsd_job_t;
+
+/* Logs of the binaries with the same name go to the same worker in order, so a perf-res file has a single writer */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    immsd_job_t *head, **tail;
+} immsd_worker_t;
+
+static immsd_process_t *immsd_processes;
+static pthread_mutex_t immsd_processes_lock = PTHREAD_MUTEX_INITIALIZER;   /* Taken by the main thread only to change the list */
+static pthread_mutex_t immsd_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static immsd_worker_t immsd_workers[MAX_WORKERS];
+static unsigned int immsd_worker_count;
+static int immsd_epfd;
+static int immsd_policy_wd;
+
+/* Tell the running instances of the binary that its perf-res record has changed, so that they swap if needed */
+static void immsd_notify_processes(const char *procpath)
+{
+    immsd_process_t *proc;
+
+    pthread_mutex_lock(&immsd_processes_lock);
+    for (proc = immsd_processes; proc; proc = proc->next) {
+        if (!strcmp(proc->path, procpath))
+            __atomic_add_fetch(&proc->shared->swap_seq, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&immsd_processes_lock);
+}
+
+/* Fold the counters of all slots into p, hist and size; time and counts are reset */
+static void immsd_fold(imms_perf_shared_t *shared, imms_perf_t p[], unsigned long hist[][IMMS_PERF_HIST_BUCKETS], imms_perf_size_t size[][IMMS_PERF_SIZE_CLASSES])
+{
+    imms_perf_slot_t *slot;
+    unsigned int i, j, k;
+
+    memset(p, 0, sizeof(imms_perf_t) * IMMS_PERF_ARRAY_SIZE);
+    for (i = 0; i < IMMS_PERF_SLOTS; i++) {
+        slot = &shared->slots[i];
+        for (j = 0; j < IMMS_PERF_ARRAY_SIZE; j++) {
+            p[j].nsec += __atomic_exchange_n(&slot->perf[j].nsec, 0, __ATOMIC_RELAXED);
+            p[j].count += __atomic_exchange_n(&slot->perf[j].count, 0, __ATOMIC_RELAXED);
+            p[j].calls += __atomic_exchange_n(&slot->perf[j].calls, 0, __ATOMIC_RELAXED);
+            for (k = 0; k < IMMS_PERF_HIST_BUCKETS; k++) {
+                if (slot->hist[j][k])
+                    hist[j][k] += __atomic_exchange_n(&slot->hist[j][k], 0, __ATOMIC_RELAXED);
+            }
+            for (k = 0; k < IMMS_PERF_SIZE_CLASSES; k++) {
+                if (!slot->size[j][k].calls)
+                    continue;
+                size[j][k].calls += __atomic_exchange_n(&slot->size[j][k].calls, 0, __ATOMIC_RELAXED);
+                size[j][k].nsec += __atomic_exchange_n(&slot->size[j][k].nsec, 0, __ATOMIC_RELAXED);
+                size[j][k].bytes += __atomic_exchange_n(&slot->size[j][k].bytes, 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/* Bytes allocated by the process and not freed yet */
+static size_t immsd_malloc_mem(imms_perf_shared_t *shared)
+{
+    size_t malloc_mem = 0;
+    unsigned int i;
+
+    for (i = 0; i < IMMS_PERF_SLOTS; i++)
+        malloc_mem += __atomic_load_n(&shared->slots[i].malloc_mem, __ATOMIC_RELAXED);
+
+    /* Scaled up samples are an estimate, which may go below zero */
+    return (long)malloc_mem < 0 ? 0 : malloc_mem;
+}
+
+/*
+ * The slow calls are left alone while the process holds their lock, which it may be preempted with;
+ * the lock is broken only once the flock of its file shows that the process and its children have exited
+ */
+static bool immsd_copy_slow_calls(immsd_process_t *proc, imms_perf_slow_call_t slow[], bool reset)
+{
+    imms_perf_shared_t *shared = proc->shared;
+    unsigned int i;
+
+    for (i = 0; __sync_lock_test_and_set(&shared->slow_lock, 1); i++) {
+        if (i < SLOW_LOCK_SPINS) {
+            sched_yield();
+            continue;
+        }
+        if (flock(proc->fd, LOCK_EX | LOCK_NB) == -1)
+            return false;
+        __sync_lock_release(&shared->slow_lock);
+    }
+    if (slow)
+        memcpy(slow, shared->slow, sizeof(shared->slow));
+    if (reset) {
+        shared->slow_min = 0;
+        memset(shared->slow, 0, sizeof(shared->slow));
+    }
+    __sync_lock_release(&shared->slow_lock);
+
+    return true;
+}
+
+/* Adapt the sample rate to keep the instrumentation within IMMS_PERF_CPU_BUDGET of the process' CPU time */
+static void immsd_adapt_sample_rate(immsd_process_t *proc, const imms_perf_t p[])
+{
+    struct timespec cputime;
+    clockid_t clock;
+    unsigned long count = 0;
+    unsigned int i, rate = proc->shared->sample_rate;
+    double cpu, usage;
+
+    if (clock_getcpuclockid(proc->pid, &clock) || clock_gettime(clock, &cputime))
+        return;
+    cpu = (double)(cputime.tv_sec - proc->cputime.tv_sec) * 1000000000 + (cputime.tv_nsec - proc->cputime.tv_nsec);
+    proc->cputime = cputime;
+    if (cpu <= 0)
+        return;
+    for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++)
+        count += p[i].count;
+    usage = count * proc->shared->sample_cost / cpu;
+    if (usage > IMMS_PERF_CPU_BUDGET)
+        rate = rate * (usage / IMMS_PERF_CPU_BUDGET) + 1;
+    else if (usage < IMMS_PERF_CPU_BUDGET / 4)
+        rate /= 2;
+    if (rate < 1)
+        rate = 1;
+    else if (rate > IMMS_PERF_SAMPLE_MAX)
+        rate = IMMS_PERF_SAMPLE_MAX;
+    __atomic_store_n(&proc->shared->sample_rate, rate, __ATOMIC_RELAXED);
+}
+
+static bool immsd_open_log(immsd_process_t *proc)
+{
+    imms_perf_t p[IMMS_PERF_ARRAY_SIZE];
+    const char *procfilename;
+    char sztime[32];
+    struct tm dt;
+    size_t len;
+
+    /* Counters gathered since the previous log belong to no allocator in particular */
+    memset(&proc->perf_log, 0, sizeof(proc->perf_log));
+    if (proc->logged)
+        immsd_fold(proc->shared, p, proc->perf_log.hist, proc->perf_log.size);
+    memset(&proc->perf_log, 0, sizeof(proc->perf_log));
+    /* If the process holds the lock of the slow calls, the log starts with the ones from before it */
+    immsd_copy_slow_calls(proc, NULL, true);
+    proc->placement_seen = __atomic_load_n(&proc->shared->placement_next, __ATOMIC_RELAXED);
+    proc->log_native = __atomic_load_n(&proc->shared->stats_native, __ATOMIC_ACQUIRE);
+    proc->log_time = time(NULL);
+    memcpy(proc->log_lib, proc->shared->lib, sizeof(proc->log_lib));
+    proc->log_lib[sizeof(proc->log_lib) - 1] = 0;
+    procfilename = (procfilename = strrchr(proc->path, '/')) ? procfilename + 1 : proc->path;
+    localtime_r(&proc->log_time, &dt);
+    strftime(sztime, sizeof(sztime), "%Y.%m.%d-%H:%M:%S", &dt);
+    if (snprintf(proc->log_path, sizeof(proc->log_path), "%s%s-%s-%d", IMMS_PERF_LOGS_PATH, procfilename, sztime,
+                 proc->pid) >= sizeof(proc->log_path)) {
+        imms_log_error("immsd_open_log error! Log path too long for:");
+        imms_log_error(proc->path);
+        proc->log_fd = -1;
+        return false;
+    }
+    len = strnlen(proc->path, PATH_MAX);
+    /* The log is locked while it is written, so that the scan of IMMS_PERF_LOGS_PATH leaves it alone */
+    if ((proc->log_fd = open(proc->log_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1 ||
+        flock(proc->log_fd, LOCK_EX | LOCK_NB) == -1 ||
+        write(proc->log_fd, proc->path, len) != len ||
+        write(proc->log_fd, "\n", 1) != 1 ||
+        write(proc->log_fd, proc->log_lib, sizeof(proc->log_lib)) != sizeof(proc->log_lib)) {
+        imms_log_error("immsd_open_log error! File name:");
+        imms_log_error(proc->log_path);
+        if (proc->log_fd != -1)
+            close(proc->log_fd);
+        proc->log_fd = -1;
+        unlink(proc->log_path);
+        return false;
+    }
+    proc->log_pos = len + 1 + sizeof(proc->log_lib);
+    proc->log_end = 0;
+    proc->logged = true;
+
+    return true;
+}
+
+/*
+ * Appends the allocated and the resident anonymous memory, swapped out pages included, to the
+ * log. The allocated memory is the one the allocators report if they could when the log was
+ * opened, the sum of the usable sizes otherwise.
+ */
+static bool immsd_write_mem_sample(immsd_process_t *proc, bool rollup)
+{
+    size_t sample[2];
+
+    /* An exited process has no memory to sample */
+    if (!imms_read_mem_usage(rollup && proc->rollup_fd != -1 ? proc->rollup_fd : proc->statm_fd, &proc->mem))
+        return true;
+    /* A log keeps the source it started with, the two don't add up to the same */
+    if (proc->log_native) {
+        if (!__atomic_load_n(&proc->shared->stats_native, __ATOMIC_ACQUIRE))
+            return true;
+        sample[0] = proc->shared->stats.allocated;
+    } else {
+        sample[0] = immsd_malloc_mem(proc->shared);
+    }
+    sample[1] = proc->mem.anon + proc->mem.swap;
+    if (pwrite(proc->log_fd, sample, sizeof(sample), proc->log_end) != sizeof(sample))
+        return false;
+    proc->log_end += sizeof(sample);
+
+    return true;
+}
+
+/*
+ * Locates the pages of the placements recorded since the last interval with move_pages and
+ * counts them by node, and by whether they are on the node of the CPU which allocated them.
+ * A block may have been freed since; its page still tells where the allocator puts memory.
+ */
+static void immsd_locate_placements(immsd_process_t *proc)
+{
+    static uint64_t page_mask;
+    imms_perf_log_t *perf_log = &proc->perf_log;
+    unsigned int next = __atomic_load_n(&proc->shared->placement_next, __ATOMIC_RELAXED), i, n;
+    void *pages[IMMS_PERF_PLACEMENTS];
+    int node[IMMS_PERF_PLACEMENTS], status[IMMS_PERF_PLACEMENTS];
+    uint64_t placement;
+
+    if (!page_mask)
+        page_mask = sysconf(_SC_PAGESIZE) - 1;
+    /* Older placements have been overwritten */
+    if (next - proc->placement_seen > IMMS_PERF_PLACEMENTS)
+        proc->placement_seen = next - IMMS_PERF_PLACEMENTS;
+    for (n = 0; proc->placement_seen != next; proc->placement_seen++) {
+        if (!(placement = __atomic_load_n(&proc->shared->placements[proc->placement_seen % IMMS_PERF_PLACEMENTS], __ATOMIC_RELAXED)))
+            continue;
+        pages[n] = (void*)(uintptr_t)(placement & ~page_mask);
+        node[n++] = (placement & page_mask) - 1;
+    }
+    /* Without NUMA support in the kernel, there is nothing to locate */
+    if (!n || syscall(SYS_move_pages, proc->pid, n, pages, NULL, status, 0) == -1)
+        return;
+    for (i = 0; i < n; i++) {
+        if (status[i] < 0)
+            continue;
+        perf_log->numa_pages[status[i] < IMMS_PERF_NUMA_NODES ? status[i] : IMMS_PERF_NUMA_NODES - 1]++;
+        if (status[i] == node[i])
+            perf_log->numa_local++;
+        else
+            perf_log->numa_remote++;
+    }
+}
+
+static bool immsd_write_log(immsd_process_t *proc)
+{
+    imms_perf_log_t *perf_log = &proc->perf_log;
+    imms_perf_t p[IMMS_PERF_ARRAY_SIZE];
+	unsigned int i;
+
+    perf_log->sample_rate = proc->shared->sample_rate;
+    perf_log->threads = __atomic_load_n(&proc->shared->slot_next, __ATOMIC_RELAXED);
+    perf_log->threads_live = __atomic_load_n(&proc->shared->threads_live, __ATOMIC_RELAXED);
+    perf_log->threads_peak = __atomic_load_n(&proc->shared->threads_peak, __ATOMIC_RELAXED);
+    perf_log->threads_created = __atomic_load_n(&proc->shared->threads_created, __ATOMIC_RELAXED);
+    immsd_locate_placements(proc);
+    /* The statistics are asked for the next interval, the process answers when it allocates next */
+    if (proc->log_native && __atomic_load_n(&proc->shared->stats_native, __ATOMIC_ACQUIRE))
+        perf_log->stats = proc->shared->stats;
+    else
+        memset(&perf_log->stats, 0, sizeof(perf_log->stats));
+    __atomic_store_n(&proc->shared->stats_seq, proc->shared->stats_seq + 1 ? proc->shared->stats_seq + 1 : 1, __ATOMIC_RELEASE);
+    immsd_fold(proc->shared, p, perf_log->hist, perf_log->size);
+    /* The slow calls copied last time stay if the process holds their lock */
+    immsd_copy_slow_calls(proc, perf_log->slow, false);
+    immsd_adapt_sample_rate(proc, p);
+    for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++) {
+        imms_avg_perf_t *perf_avg = &perf_log->perf[i];
+
+        /* To prevent division by zero */
+        if (p[i].count) {
+            /* Timed calls stand for all calls, so their total time is scaled up the same way */
+            perf_avg->sec = imms_average_winc(perf_avg->sec, (long double)p[i].nsec * p[i].calls / p[i].count / 1000000000, perf_avg->count, p[i].calls);
+            perf_avg->count += p[i].calls;
+        }
+    }
+    if (pwrite(proc->log_fd, perf_log, sizeof(*perf_log), proc->log_pos) != sizeof(*perf_log))
+        return false;
+    if (!proc->log_end)
+        proc->log_end = proc->log_pos + sizeof(*perf_log);
+
+    return immsd_write_mem_sample(proc, true);
+}
+
+/* Memory moves faster than the counters are worth folding, so it is sampled in between with a read of statm */
+static void immsd_sample_memory()
+{
+    immsd_process_t *proc;
+
+    for (proc = immsd_processes; proc; proc = proc->next) {
+        if (proc->log_fd != -1 && proc->log_end && !immsd_write_mem_sample(proc, false)) {
+            imms_log_error("immsd_sample_memory write error! File name:");
+            imms_log_error(proc->log_path);
+        }
+    }
+}
+
+static void immsd_dispatch_perf_log(const char *path, const char *procpath);
+
+static void immsd_close_log(immsd_process_t *proc)
+{
+    close(proc->log_fd);
+    proc->log_fd = -1;
+    immsd_dispatch_perf_log(proc->log_path, proc->path);
+}
+
+/* Sample the counters of a process into its perf log; returns false once the process has exited */
+static bool immsd_sample_process(immsd_process_t *proc)
+{
+    imms_perf_shared_t *shared = proc->shared;
+    bool running, test_mode;
+
+    running = flock(proc->fd, LOCK_EX | LOCK_NB) == -1;
+    test_mode = __atomic_load_n(&shared->test_mode, __ATOMIC_ACQUIRE);
+    if (proc->log_fd != -1) {
+        if (!immsd_write_log(proc)) {
+            imms_log_error("immsd_sample_process write error! File name:");
+            imms_log_error(proc->log_path);
+            close(proc->log_fd);
+            proc->log_fd = -1;
+            unlink(proc->log_path);
+        } else if (!running || !test_mode || strncmp(proc->log_lib, shared->lib, sizeof(proc->log_lib))) {
+            immsd_close_log(proc);
+        } else if (difftime(time(NULL), proc->log_time) >= MAX_TEST_TIME) {
+            /* A long running process has tested its allocator long enough; it goes on with the next one once the log is analysed */
+            proc->rotated_seq = __atomic_load_n(&shared->swap_seq, __ATOMIC_ACQUIRE);
+            proc->rotated = true;
+            immsd_close_log(proc);
+        }
+    }
+    if (!running)
+        return false;
+    /* A log which failed the analysis never bumps swap_seq */
+    if (proc->rotated && ((shared->swap_seq != proc->rotated_seq && __atomic_load_n(&shared->swap_ack, __ATOMIC_ACQUIRE) == shared->swap_seq) ||
+        difftime(time(NULL), proc->log_time) >= 2 * MAX_TEST_TIME))
+        proc->rotated = false;
+    /* The memory of a process can't be sampled once it has exited, so a new log starts with a sample */
+    if (proc->log_fd == -1 && test_mode && !proc->rotated && immsd_open_log(proc) && !immsd_write_log(proc)) {
+        close(proc->log_fd);
+        proc->log_fd = -1;
+        unlink(proc->log_path);
+    }
+
+    return true;
+}
+
+/* The key written by the process is trusted only for the binary that /proc says it runs, see imms_process_key */
+static bool immsd_check_key(pid_t pid, const char *key)
+{
+    char path[64], exe[PATH_MAX + 1];
+    ssize_t len;
+    size_t i;
+
+    snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    if ((len = readlink(path, exe, sizeof(exe) - 1)) == -1)
+        return false;
+    exe[len] = 0;
+    /* The binary may have been upgraded since the process started */
+    if (len > 10 && !strcmp(exe + len - 10, " (deleted)"))
+        exe[len -= 10] = 0;
+    if (strncmp(key, exe, len))
+        return false;
+    key += len;
+    if (!*key)
+        return true;
+    /* Policy-selected arguments, cgroup or environment only split the records of the same binary */
+    if (*key++ != '#')
+        return false;
+    for (i = 0; i < 16; i++) {
+        if (!isxdigit((unsigned char)key[i]))
+            return false;
+    }
+
+    return !key[i];
+}
+
+/* Whether the process of pid has the file of st open, as the process which created it keeps it */
+static bool immsd_holds_file(pid_t pid, const struct stat *st)
+{
+    char path[64 + NAME_MAX];
+    struct stat fdst;
+    struct dirent *de;
+    DIR *dir;
+    bool found = false;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    if (!(dir = opendir(path)))
+        return false;
+    while (!found && (de = readdir(dir))) {
+        snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, de->d_name);
+        found = *de->d_name != '.' && !stat(path, &fdst) && fdst.st_dev == st->st_dev && fdst.st_ino == st->st_ino;
+    }
+    closedir(dir);
+
+    return found;
+}
+
+/*****************************************************************************************
+ *  Start sampling the process of the file name in IMMS_SHARED_PATH. Any user can create
+ *  files there, so the file must be a regular one of the right size owned by the user the
+ *  process of its name runs as, and the key of the process must name the binary it runs.
+ *  The pid and the key are copied then; what the process writes into them later is
+ *  ignored. A process in another pid namespace names its file by a pid which isn't its
+ *  own here, so the process of the pid must also hold the file; the others are left out.
+ *****************************************************************************************/
+static void immsd_add_process(const char *name)
+{
+    immsd_process_t *proc;
+    imms_perf_shared_t *shared = MAP_FAILED;
+    struct epoll_event ev;
+    struct stat st, procst;
+    char path[PATH_MAX + 1], key[PATH_MAX + 1], *sz;
+    long pid;
+    int fd;
+
+    for (proc = immsd_processes; proc; proc = proc->next) {
+        if (!strcmp(proc->name, name))
+            return;
+    }
+    snprintf(path, sizeof(path), "%s%s", IMMS_SHARED_PATH, name);
+    if ((fd = open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK)) == -1) {
+        if (ELOOP == errno)
+            unlink(path);
+        return;
+    }
+    /* Files are named <pid>.<n> by imms_perf_share */
+    pid = strtol(name, &sz, 10);
+    if (pid <= 0 || *sz != '.' || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size != sizeof(*shared))
+        goto error;
+    snprintf(key, sizeof(key), "/proc/%ld", pid);
+    if (stat(key, &procst) == -1 || procst.st_uid != st.st_uid)
+        goto error;
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED || __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != IMMS_SHARED_MAGIC)
+        goto error;
+    memcpy(key, shared->path, sizeof(key));
+    key[sizeof(key) - 1] = 0;
+    if (!immsd_check_key(pid, key) || !(proc = calloc(1, sizeof(*proc))))
+        goto error;
+    /* Opened before the check, so that it can't refer to a later process which reused the pid */
+    proc->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (!immsd_holds_file(pid, &st)) {
+        if (proc->pidfd != -1)
+            close(proc->pidfd);
+        free(proc);
+        goto error;
+    }
+    strcpy(proc->name, name);
+    strcpy(proc->path, key);
+    proc->pid = pid;
+    proc->fd = fd;
+    proc->shared = shared;
+    proc->log_fd = -1;
+    proc->rollup_fd = imms_open_mem_usage(pid, "smaps_rollup");
+    proc->statm_fd = imms_open_mem_usage(pid, "statm");
+    /* Without a pidfd the exit is noticed by the next sample */
+    ev.events = EPOLLIN;
+    ev.data.fd = proc->pidfd;
+    if (proc->pidfd != -1 && epoll_ctl(immsd_epfd, EPOLL_CTL_ADD, proc->pidfd, &ev) == -1) {
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+    pthread_mutex_lock(&immsd_processes_lock);
+    proc->next = immsd_processes;
+    immsd_processes = proc;
+    pthread_mutex_unlock(&immsd_processes_lock);
+
+    return;
+
+error:
+    imms_log_error("immsd_add_process error! File name:");
+    imms_log_error(path);
+    if (shared != MAP_FAILED)
+        munmap(shared, sizeof(*shared));
+    close(fd);
+    unlink(path);
+}
+
+static void immsd_remove_process(immsd_process_t **pproc)
+{
+    immsd_process_t *proc = *pproc;
+    char path[PATH_MAX + 1];
+
+    pthread_mutex_lock(&immsd_processes_lock);
+    *pproc = proc->next;
+    pthread_mutex_unlock(&immsd_processes_lock);
+    snprintf(path, sizeof(path), "%s%s", IMMS_SHARED_PATH, proc->name);
+    unlink(path);
+    munmap(proc->shared, sizeof(*proc->shared));
+    close(proc->fd);
+    if (proc->pidfd != -1)
+        close(proc->pidfd);
+    if (proc->rollup_fd != -1)
+        close(proc->rollup_fd);
+    if (proc->statm_fd != -1)
+        close(proc->statm_fd);
+    free(proc);
+}
+
+/* Sample the process of pidfd, or all of them if pidfd is -1 */
+static void immsd_sample_processes(int pidfd)
+{
+    immsd_process_t *proc, **pproc;
+
+    for (pproc = &immsd_processes; (proc = *pproc);) {
+        if (pidfd != -1 && proc->pidfd != pidfd) {
+            pproc = &proc->next;
+            continue;
+        }
+        /* The pidfd stays readable, while a child may still hold the flock; the periodic samples finish the job */
+        if (pidfd != -1) {
+            epoll_ctl(immsd_epfd, EPOLL_CTL_DEL, pidfd, NULL);
+            close(pidfd);
+            proc->pidfd = -1;
+        }
+        if (immsd_sample_process(proc))
+            pproc = &proc->next;
+        else
+            immsd_remove_process(pproc);
+    }
+}
+
+/* Pick up the processes which are already running, or whose events were lost */
+static void immsd_scan_processes()
+{
+    DIR *dir;
+    struct dirent *de;
+
+    if (!(dir = opendir(IMMS_SHARED_PATH)))
+        return;
+    while ((de = readdir(dir))) {
+        if (*de->d_name != '.')
+            immsd_add_process(de->d_name);
+    }
+    closedir(dir);
+}
+
+/* A process links its file once it has started; the policy is compiled again whenever one of its sources changes */
+static void immsd_handle_events(int fd)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                immsd_scan_processes();
+                imms_policy_compile();
+            } else if (ev->wd == immsd_policy_wd) {
+                if (ev->len && (!strcmp(ev->name, strrchr(IMMS_POLICY_FILE, '/') + 1) || !strcmp(ev->name, strrchr(IMMS_POLICY_EXCLUDED_FILE, '/') + 1)))
+                    imms_policy_compile();
+            } else if (ev->len && *ev->name != '.') {
+                immsd_add_process(ev->name);
+            }
         }
     }
 }
 
 static void immsd_process_perf_log(const char *path)
 {
-    imms_perf_result_t perfres;
-    imms_avg_perf_t perf_avg, perf[IMMS_PERF_ARRAY_SIZE];
+    static __thread imms_perf_result_t perfres;
+    imms_avg_perf_t perf_avg;
+    imms_perf_log_t perf_log;
     long double malloc_mem, real_mem;
-    size_t i;
-    char c, *sz, perflogpath[PATH_MAX + 1];
-    imms_library_t lib;
+    double mean, memfrag, feature[IMMS_PERF_FEATURES], vote[IMMS_MALLOC_LIB_MAX];
+    bool fingerprinted;
+    char registered[IMMS_MALLOC_LIB_MAX][IMMS_MALLOC_LIB_NAME_MAX];
+    imms_perf_res_entry_t entry;
+    const char *procfilename;
+    char perflogline[PATH_MAX + 1];
+    bool indexed = true;
+    unsigned int file;
+    size_t i, j, nregistered, mem[2], peak;
+    struct stat st;
+    char *log, *end;
+    char *sz, perflogpath[PATH_MAX + 1], procpath[PATH_MAX + 1], libname[IMMS_MALLOC_LIB_NAME_MAX];
+    off_t pos;
+    int lib;
     time_t t;
     int fd;
-    bool opened;
+    bool opened, predicted;
 
     fd = open(path, O_RDONLY);
     if (-1 == fd) {
@@ -97,51 +1051,52 @@ static void immsd_process_perf_log(const char *path)
         imms_log_error(path);
         return;
     }
-    i = 0;
-    do {
-        if (read(fd, &c, 1) <= 0) {
-            imms_log_error("immsd_process_perf_log read error! File name:");
-            imms_log_error(path);
-            goto errret;
-        }
-        perflogpath[i++] = c;
-    } while ((c != '\n') && (c != '\r'));
-    perflogpath[i - 1] = 0;
-    if (read(fd, &lib, sizeof(lib)) != sizeof(lib)) {
-        imms_log_error("immsd_process_perf_log read error on lib! File name:");
+    /* The whole log is parsed in one pass over its mapping */
+    if (fstat(fd, &st) == -1 || !st.st_size ||
+        (log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        imms_log_error("immsd_process_perf_log mmap error! File name:");
         imms_log_error(path);
         goto errret;
     }
-    if (lib > IMMS_MALLOC_LIB_END) {
-        imms_log_error("immsd_process_perf_log lib exceeded limit! File name:");
+    end = log + st.st_size;
+    if (!(sz = memchr(log, '\n', st.st_size)) || sz - log > PATH_MAX ||
+        end - ++sz < (ptrdiff_t)(sizeof(libname) + sizeof(perf_log))) {
+        imms_log_error("immsd_process_perf_log read error! File name:");
         imms_log_error(path);
+        munmap(log, st.st_size);
         goto errret;
     }
-    if (read(fd, perf, sizeof(perf)) != sizeof(perf)) {
-        imms_log_error("immsd_process_perf_log read error on perf! File name:");
-        imms_log_error(path);
-        goto errret;
+    memcpy(perflogpath, log, sz - log - 1);
+    perflogpath[sz - log - 1] = 0;
+    strcpy(procpath, perflogpath);
+    procfilename = (procfilename = strrchr(procpath, '/')) ? procfilename + 1 : procpath;
+    memcpy(libname, sz, sizeof(libname));
+    libname[sizeof(libname) - 1] = 0;
+    memcpy(&perf_log, sz += sizeof(libname), sizeof(perf_log));
+    /* The mean time of a call, the operations weigh by their calls */
+    for (i = 0, perf_avg.sec = 0, perf_avg.count = 0; i < IMMS_PERF_ARRAY_SIZE; i++) {
+        if (perf_log.perf[i].count) {
+            perf_avg.sec = imms_average_winc(perf_avg.sec, perf_log.perf[i].sec * perf_log.perf[i].count, perf_avg.count, perf_log.perf[i].count);
+            perf_avg.count += perf_log.perf[i].count;
+        }
     }
-    for (i = 0, perf_avg.sec = 0; i < IMMS_PERF_ARRAY_SIZE; i++)
-        perf_avg.sec = imms_average(perf_avg.sec, perf[i].sec, i);
-    for (malloc_mem = real_mem = i = 0;;) {
-        size_t mem[2];
-
-        if (read(fd, &mem[0], sizeof(mem[0])) == sizeof(mem[0]) &&
-            read(fd, &mem[1], sizeof(mem[1])) == sizeof(mem[1])) {
-            /* malloc_mem can't be bigger than real_mem; however, OS don't allocate page for
-               untouched memory areas. Therefore, malloc_mem can be bigger temporarily. */
-            if (mem[0] >= mem[1]) {
-                imms_log_error("immsd_process_perf_log (malloc_mem >= real_mem) warning! File name:");
-                imms_log_error(path);
-            } else {
-                malloc_mem = imms_average(malloc_mem, mem[0], i);
-                real_mem = imms_average(real_mem, mem[1], i++);
-            }
+    for (malloc_mem = real_mem = peak = i = 0, sz += sizeof(perf_log); end - sz >= (ptrdiff_t)sizeof(mem); sz += sizeof(mem)) {
+        /* Samples follow a path of any length, so they may be unaligned */
+        memcpy(mem, sz, sizeof(mem));
+        /* malloc_mem can't be bigger than real_mem; however, OS don't allocate page for
+           untouched memory areas. Therefore, malloc_mem can be bigger temporarily. */
+        if (mem[0] >= mem[1]) {
+            imms_log_error("immsd_process_perf_log (malloc_mem >= real_mem) warning! File name:");
+            imms_log_error(path);
         } else {
-            break;
+            malloc_mem = imms_average(malloc_mem, mem[0], i);
+            real_mem = imms_average(real_mem, mem[1], i++);
+            if (mem[1] > peak)
+                peak = mem[1];
         }
     }
+    munmap(log, st.st_size);
+    fingerprinted = immsd_fingerprint(&perf_log, real_mem, feature);
     if (!i) {
         imms_log_error("immsd_process_perf_log malloc_mem or real_mem count is ZERO! File name:");
         imms_log_error(path);
@@ -154,12 +1109,21 @@ static void immsd_process_perf_log(const char *path)
     }
 
 makeperfres:
-    if (!(opened = imms_open_perf_log_file(perflogpath, sizeof(perflogpath), IMMS_PERF_RES_PATH)) &&
-        !imms_make_log_file(IMMS_PERF_RES_PATH, perflogpath, sizeof(perflogpath), true)) {
-        imms_log_error("immsd_process_perf_log perf-res log file error! File name:");
-        imms_log_error(path);
-        return;
+    /* The index tells the record without probing the records of the binaries with the same name */
+    if ((opened = indexed && imms_perf_res_lookup(procpath, &entry))) {
+        snprintf(perflogpath, sizeof(perflogpath), "%s%s-%u", IMMS_PERF_RES_PATH, procfilename, entry.file);
+        opened = !access(perflogpath, F_OK);
     }
+    if (!(indexed = opened)) {
+        strcpy(perflogpath, procpath);
+        if (!(opened = imms_open_perf_log_file(perflogpath, sizeof(perflogpath), IMMS_PERF_RES_PATH)) &&
+            !imms_make_log_file(IMMS_PERF_RES_PATH, perflogpath, sizeof(perflogpath), true)) {
+            imms_log_error("immsd_process_perf_log perf-res log file error! File name:");
+            imms_log_error(path);
+            return;
+        }
+    }
+    file = strtoul(strrchr(perflogpath, '-') + 1, NULL, 10);
     fd = open(perflogpath, O_RDWR);
     if (-1 == fd) {
         imms_log_error("immsd_process_perf_log open procfile error! File name:");
@@ -169,64 +1133,106 @@ makeperfres:
     if (opened) {
         ssize_t readbytes;
 
-        do {
-            if (!(readbytes = read(fd, &c, 1)))
-                goto perfreserr;
-            if (readbytes != 1) {
-                imms_log_error("immsd_process_perf_log read procfile error! File name:");
-                imms_log_error(perflogpath);
-                goto cleanup;
-            }
-        } while ((c != '\n') && (c != '\r'));
-        if (!(readbytes = read(fd, &perfres, sizeof(perfres))))
-            goto perfreserr;
-        if (readbytes != sizeof(perfres)) {
-            imms_log_error("immsd_process_perf_log read error on perfres! File name:");
+        /* The record starts with the path of the binary, which an index entry may no longer match */
+        pos = strlen(procpath) + 1;
+        if ((readbytes = read(fd, perflogline, pos)) == -1) {
+            imms_log_error("immsd_process_perf_log read procfile error! File name:");
             imms_log_error(perflogpath);
             goto cleanup;
         }
-        if (lseek(fd, -sizeof(perfres), SEEK_CUR) == -1) {
-            imms_log_error("immsd_process_perf_log (opened) lseek error! File name:");
-            imms_log_error(perflogpath);
-            goto cleanup;
+        if (readbytes != pos || memcmp(perflogline, procpath, pos - 1) || perflogline[pos - 1] != '\n') {
+            if (!indexed)
+                goto perfreserr;
+            close(fd);
+            indexed = false;
+            goto makeperfres;
         }
+        if (!imms_read_perf_result(fd, &perfres))
+            goto perfreserr;
     } else {
-        if (lseek(fd, 0, SEEK_END) == -1) {
+        if ((pos = lseek(fd, 0, SEEK_END)) == -1) {
             imms_log_error("immsd_process_perf_log (!opened) lseek error! File name:");
             imms_log_error(perflogpath);
             goto cleanup;
         }
-        memset(perfres.smr, 0, sizeof(perfres.smr));
+        memset(&perfres, 0, sizeof(perfres));
+        perfres.magic = IMMS_PERF_RES_MAGIC;
+        perfres.version = IMMS_PERF_RES_VERSION;
+    }
+    /* Every registered library gets a summary so that it is explored */
+    pthread_mutex_lock(&immsd_registry_lock);
+    imms_load_malloc_registry();
+    for (i = 0; i < imms_malloc_lib_count; i++)
+        imms_find_perf_summary(&perfres, imms_malloc_libs[i].name, true);
+    for (nregistered = 0; nregistered < imms_malloc_lib_count; nregistered++)
+        memcpy(registered[nregistered], imms_malloc_libs[nregistered].name, IMMS_MALLOC_LIB_NAME_MAX);
+    pthread_mutex_unlock(&immsd_registry_lock);
+    if ((lib = imms_find_perf_summary(&perfres, libname, true)) == -1) {
+        imms_log_error("immsd_process_perf_log too many libraries! File name:");
+        imms_log_error(perflogpath);
+        goto cleanup;
     }
     if (perfres.smr[lib].count < MAX_TEST_AMOUNT && difftime(t, perfres.smr[lib].time) >= MIN_TIME_TO_REPERF) {
-        perfres.smr[lib].sec = imms_average(perfres.smr[lib].sec, perf_avg.sec, perfres.smr[lib].count);
         if (real_mem < malloc_mem) {
             imms_log_error("immsd_process_perf_log (real_mem < malloc_mem) error! File name:");
             imms_log_error(path);
             goto errret;
         }
-        perfres.smr[lib].memfrag = imms_average(perfres.smr[lib].memfrag, (real_mem - malloc_mem) / real_mem, perfres.smr[lib].count);
+        memfrag = (real_mem - malloc_mem) / real_mem;
+        /* Welford's update; the sums start late for records of version 1 whose means have older runs */
+        mean = perfres.smr[lib].sec;
+        perfres.smr[lib].sec = imms_average(mean, perf_avg.sec, perfres.smr[lib].count);
+        perfres.smr[lib].sec_m2 += (perf_avg.sec - mean) * (perf_avg.sec - perfres.smr[lib].sec);
+        mean = perfres.smr[lib].memfrag;
+        perfres.smr[lib].memfrag = imms_average(mean, memfrag, perfres.smr[lib].count);
+        perfres.smr[lib].memfrag_m2 += (memfrag - mean) * (memfrag - perfres.smr[lib].memfrag);
+        perfres.smr[lib].nvar++;
         perfres.smr[lib].avgmem = imms_average(perfres.smr[lib].avgmem, real_mem, perfres.smr[lib].count);
+        perfres.smr[lib].peakmem = imms_average(perfres.smr[lib].peakmem, peak, perfres.smr[lib].count);
+        perfres.smr[lib].threads = imms_average(perfres.smr[lib].threads, perf_log.threads_peak, perfres.smr[lib].count);
+        perfres.smr[lib].contention = imms_average(perfres.smr[lib].contention, immsd_contention(perf_log.hist), perfres.smr[lib].count);
+        if (perf_log.numa_local + perf_log.numa_remote)
+            perfres.smr[lib].remote = imms_average(perfres.smr[lib].remote, (double)perf_log.numa_remote / (perf_log.numa_local + perf_log.numa_remote), perfres.smr[lib].count);
+        for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++) {
+            for (j = 0; j < IMMS_PERF_HIST_BUCKETS; j++)
+                perfres.smr[lib].hist[i][j] += perf_log.hist[i][j];
+        }
+        perfres.smr[lib].p99 = immsd_hist_percentile(perfres.smr[lib].hist, 0.99);
+        for (i = 0; i < IMMS_PERF_ARRAY_SIZE; i++) {
+            for (j = 0; j < IMMS_PERF_SIZE_CLASSES; j++) {
+                perfres.smr[lib].size[i][j].calls += perf_log.size[i][j].calls;
+                perfres.smr[lib].size[i][j].sec += perf_log.size[i][j].nsec / 1000000000.0;
+                perfres.smr[lib].size[i][j].bytes += perf_log.size[i][j].bytes;
+            }
+        }
         perfres.smr[lib].time = t;
         perfres.smr[lib].count++;
-        immsd_analyse(&perfres);
-    }
-    perfres.test_mode = false;
-    for (i = 0, lib++; i <= IMMS_MALLOC_LIB_END; i++, lib++) {
-        lib %= IMMS_MALLOC_LIB_END + 1;
-        if (perfres.smr[lib].count < MAX_TEST_AMOUNT && difftime(t, perfres.smr[lib].time) >= MIN_TIME_TO_REPERF) {
-            perfres.nextlib = lib;
-            perfres.test_mode = true;
-            break;
-        }
+        if (!immsd_optimise(&perfres, immsd_policy_rule(procpath)))
+            immsd_analyse(&perfres);
+    }
+    if (fingerprinted) {
+        for (i = 0; i < IMMS_PERF_FEATURES; i++)
+            perfres.fingerprint[i] = imms_average(perfres.fingerprint[i], feature[i], perfres.fingerprinted);
+        perfres.fingerprinted++;
     }
-    if (write(fd, &perfres, sizeof(perfres)) != sizeof(perfres)) {
+    /* A binary which isn't tuned yet tests what the nearest tuned binaries chose first */
+    memset(vote, 0, sizeof(vote));
+    predicted = perfres.smr[perfres.result[2]].nvar < MIN_TEST_AMOUNT &&
+                immsd_predict(&perfres, registered, nregistered, procpath, !opened, vote);
+    immsd_schedule(&perfres, registered, nregistered, lib, t, predicted ? vote : NULL);
+    if (lseek(fd, pos, SEEK_SET) != pos || !imms_write_perf_result(fd, &perfres) ||
+        ftruncate(fd, lseek(fd, 0, SEEK_CUR)) == -1) {
         imms_log_error("immsd_process_perf_log write error on perfres! File name:");
         imms_log_error(perflogpath);
         close(fd);
         unlink(perflogpath);
         return;
     }
+    if (!imms_perf_res_update(procpath, file, &perfres)) {
+        imms_log_error("immsd_process_perf_log index update error! File name:");
+        imms_log_error(perflogpath);
+    }
+    immsd_notify_processes(procpath);
     if (sz = strrchr(path, '/')) {
         strcpy(perflogpath, IMMS_ANALYSED_PERF_LOGS_PATH);
         strcat(perflogpath, ++sz);
@@ -259,36 +1265,196 @@ errret:
     }
 }
 
+/*
+ * The records are the truth, the index is brought up to date with them; a binary with several records uses the first one.
+ * Pruning first also drops the entries a previous immsd died writing, before they're looked up.
+ */
+static void immsd_index_perf_res()
+{
+    static imms_perf_result_t perfres;
+    imms_perf_res_entry_t entry;
+    char path[PATH_MAX + 1], procpath[PATH_MAX + 1], *sz;
+    struct dirent *de;
+    unsigned int file;
+    ssize_t len;
+    DIR *dir;
+    int fd;
+
+    if (!imms_perf_res_open(true)) {
+        imms_log_error("immsd_index_perf_res index open error!");
+        return;
+    }
+    imms_perf_res_prune();
+    if (!(dir = opendir(IMMS_PERF_RES_PATH)))
+        return;
+    while ((de = readdir(dir))) {
+        if (!(sz = strrchr(de->d_name, '-')))
+            continue;
+        file = strtoul(sz + 1, NULL, 10);
+        snprintf(path, sizeof(path), "%s%s", IMMS_PERF_RES_PATH, de->d_name);
+        if ((fd = open(path, O_RDONLY)) == -1)
+            continue;
+        if ((len = read(fd, procpath, sizeof(procpath) - 1)) > 0) {
+            procpath[len] = 0;
+            if ((sz = strchr(procpath, '\n'))) {
+                *sz = 0;
+                if (lseek(fd, sz - procpath + 1, SEEK_SET) != -1 && imms_read_perf_result(fd, &perfres) &&
+                    (!imms_perf_res_lookup(procpath, &entry) || entry.file >= file))
+                    imms_perf_res_update(procpath, file, &perfres);
+            }
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
+static void* immsd_worker(void *arg)
+{
+    immsd_worker_t *worker = arg;
+    immsd_job_t *job;
+
+    for (;;) {
+        pthread_mutex_lock(&worker->lock);
+        while (!(job = worker->head))
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        if (!(worker->head = job->next))
+            worker->tail = &worker->head;
+        pthread_mutex_unlock(&worker->lock);
+        immsd_process_perf_log(job->path);
+        free(job);
+    }
+
+    return NULL;
+}
+
+static void immsd_start_workers()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    immsd_worker_t *worker;
+
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+    for (immsd_worker_count = 0; immsd_worker_count < n; immsd_worker_count++) {
+        worker = &immsd_workers[immsd_worker_count];
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        worker->tail = &worker->head;
+        if (pthread_create(&worker->thread, NULL, immsd_worker, worker)) {
+            imms_log_error("immsd_start_workers pthread_create error!");
+            break;
+        }
+    }
+}
+
+/* Queue the log to the worker of the binary; the perf-res files of binaries with the same name share a prefix, so the name is hashed */
+static void immsd_dispatch_perf_log(const char *path, const char *procpath)
+{
+    const char *procfilename = (procfilename = strrchr(procpath, '/')) ? procfilename + 1 : procpath;
+    immsd_worker_t *worker;
+    immsd_job_t *job;
+    unsigned int hash = 2166136261u;
+
+    if (!immsd_worker_count || !(job = malloc(sizeof(*job)))) {
+        immsd_process_perf_log(path);
+        return;
+    }
+    for (; *procfilename; procfilename++)
+        hash = (hash ^ (unsigned char)*procfilename) * 16777619u;
+    worker = &immsd_workers[hash % immsd_worker_count];
+    strcpy(job->path, path);
+    job->next = NULL;
+    pthread_mutex_lock(&worker->lock);
+    *worker->tail = job;
+    worker->tail = &job->next;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
 int main()
 {
+    struct epoll_event ev;
+    struct itimerspec its = { { MEM_SAMPLE_TIME, 0 }, { MEM_SAMPLE_TIME, 0 } };
     DIR *dir;
     struct dirent *de;
-    char path[PATH_MAX + 1];
-    int fd;
+    char path[PATH_MAX + 1], procpath[PATH_MAX + 1];
+    uint64_t ticks, elapsed = 0;
+    ssize_t len;
+    int fd, infd, tfd;
 
     imms_init_daemon("immsd");
     if (chdir(IMMS_PERF_LOGS_PATH)) {
         imms_log_error("main chdir error!");
         return -1;
     }
-    dir = opendir(IMMS_PERF_LOGS_PATH);
-    for (;;) {
-        sleep(SLEEP_TIME);
-        rewinddir(dir);
+    /* Every user's processes publish their counters there */
+    if (mkdir(IMMS_SHARED_PATH, 01777) == -1 && errno != EEXIST) {
+        imms_log_error("main shared directory error!");
+        return -1;
+    }
+    /* Processes are picked up as they start and their logs analysed as they exit; the timer samples the running ones */
+    if ((immsd_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        (infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+        inotify_add_watch(infd, IMMS_SHARED_PATH, IN_CREATE) == -1 ||
+        (immsd_policy_wd = inotify_add_watch(infd, IMMS_PATH, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE)) == -1 ||
+        (tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1 ||
+        timerfd_settime(tfd, 0, &its, NULL) == -1) {
+        imms_log_error("main event setup error!");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = infd;
+    if (epoll_ctl(immsd_epfd, EPOLL_CTL_ADD, infd, &ev) == -1) {
+        imms_log_error("main epoll_ctl error!");
+        return -1;
+    }
+    ev.data.fd = tfd;
+    if (epoll_ctl(immsd_epfd, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+        imms_log_error("main epoll_ctl error!");
+        return -1;
+    }
+    imms_policy_compile();
+    immsd_index_perf_res();
+    immsd_start_workers();
+    immsd_scan_processes();
+    /* Logs left over by a previous run of immsd */
+    if ((dir = opendir(IMMS_PERF_LOGS_PATH))) {
         while (de = readdir(dir)) {
             if (!strrchr(de->d_name, '-'))
                 continue;
             if ((fd = open(de->d_name, O_RDONLY)) != -1) {
                 if (flock(fd, LOCK_EX | LOCK_NB) != -1) {
+                    /* The first line is the path of the binary */
+                    len = read(fd, procpath, sizeof(procpath) - 1);
                     close(fd);
+                    procpath[len > 0 ? len : 0] = 0;
+                    procpath[strcspn(procpath, "\n")] = 0;
                     strcpy(path, IMMS_PERF_LOGS_PATH);
                     strcat(path, de->d_name);
-                    immsd_process_perf_log(path);
+                    immsd_dispatch_perf_log(path, procpath);
                 } else {
                     close(fd);
                 }
             }
         }
+        closedir(dir);
+    }
+    for (;;) {
+        if (epoll_wait(immsd_epfd, &ev, 1, -1) <= 0)
+            continue;
+        if (ev.data.fd == infd) {
+            immsd_handle_events(infd);
+        } else if (ev.data.fd == tfd) {
+            if (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+                continue;
+            if ((elapsed += ticks * MEM_SAMPLE_TIME) >= SLEEP_TIME) {
+                elapsed = 0;
+                immsd_sample_processes(-1);
+            } else {
+                immsd_sample_memory();
+            }
+        } else {
+            immsd_sample_processes(ev.data.fd);
+        }
     }
 
     return 0;